@@ -0,0 +1,171 @@
+/*
+ * Copyright (C) 2024 Dirk Sarodnick
+ * All rights reserved.
+ */
+
+// compares the former string concatenation with the formatter, in time and heap allocations per relayed line
+#include "../ircRelay.cpp"
+
+#include <new>
+#include <string>
+
+// only allocations of the thread that formats get counted, the threads of the relay do their own thing
+static thread_local size_t allocations = 0;
+static volatile size_t sink;
+
+// the counting operators below are the replacements, gcc just cannot tell once they got inlined
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    allocations++;
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == NULL) throw std::bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t size) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t size) noexcept {
+    free(memory);
+}
+
+// the team colours as they were picked before, one chain per event
+static std::string ColorBefore(int team) {
+    std::string colorcode;
+    if (team == 0) colorcode = "\00307";
+    else if (team == 1) colorcode = "\00304";
+    else if (team == 2) colorcode = "\00303";
+    else if (team == 3) colorcode = "\00302";
+    else if (team == 4) colorcode = "\00306";
+    else if (team == 5) colorcode = "\00310";
+    else if (team == 6) colorcode = "\00314";
+    else colorcode = "\017";
+    return colorcode;
+}
+
+static size_t ChatBefore(const std::string& ircChannel, const std::string& ircPrefix, const bz_BasePlayerRecord& speaker, const std::string& message, bool action) {
+    std::string player = speaker.callsign;
+    std::string colorcode = ColorBefore(speaker.team);
+    if (action) {
+        std::string subtotal = colorcode + player + " " + message;
+        std::string total = "PRIVMSG #" + ircChannel + " :\001ACTION " + ircPrefix + subtotal + "\001";
+        return total.size();
+    }
+    std::string subtotal = colorcode + player + ": " + "\017" + message;
+    std::string total = "PRIVMSG #" + ircChannel + " :" + ircPrefix + subtotal;
+    return total.size();
+}
+
+static size_t JoinBefore(const std::string& ircChannel, const std::string& ircPrefix, const bz_BasePlayerRecord& joiner) {
+    std::string callsign = joiner.callsign;
+    std::string ip = joiner.ipAddress;
+    std::string colorcode = ColorBefore(joiner.team);
+    std::string player_team = GetTeamStyle(joiner.team).name;
+    std::string subtotal = colorcode + callsign + "\017" + " joined as a " + player_team + " from " + ip;
+    std::string total = "PRIVMSG #" + ircChannel + " :" + ircPrefix + subtotal;
+    return total.size();
+}
+
+static size_t PartBefore(const std::string& ircChannel, const std::string& ircPrefix, const bz_BasePlayerRecord& leaver) {
+    std::string callsign = leaver.callsign;
+    std::string colorcode = ColorBefore(leaver.team);
+    std::string subtotal = colorcode + callsign + "\017" + " left the game";
+    std::string total = "PRIVMSG #" + ircChannel + " :" + ircPrefix + subtotal;
+    return total.size();
+}
+
+// runs a step a number of times and reports its cost per call
+template <typename Step>
+static bool Measure(const char* name, int rounds, Step step) {
+    size_t before = allocations;
+    double start = ircRelay::Now();
+    for (int i = 0; i < rounds; i++) step(i);
+    double elapsed = ircRelay::Now() - start;
+    double perCall = (double)(allocations - before) / rounds;
+    printf("%-14s %8.1f ns/line %6.2f allocations/line\n", name, elapsed * 1e9 / rounds, perCall);
+    return allocations == before;
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+
+    // no address, so the relay never connects and only the game thread side gets measured
+    bz_stubSetBZDB("_ircChannel", "bzflag");
+    bz_stubSetBZDB("_ircPrefix", "[bz] ");
+    bz_stubSetBZDB("_ircNick", "relay");
+    ircRelay plugin;
+    plugin.Init("");
+
+    bz_BasePlayerRecord record;
+    record.playerID = 7;
+    record.callsign = "SomeLongerCallsign";
+    record.ipAddress = "192.168.100.200";
+    record.team = eBlueTeam;
+    record.wins = 0;
+    record.losses = 0;
+    record.teamKills = 0;
+    ircRelay::Enter(record.playerID, &record);
+    const RosterEntry& player = roster[record.playerID];
+    std::string message = "anyone up for a round of ctf on the new map later tonight?";
+    std::string ircChannel = "bzflag";
+    std::string ircPrefix = "[bz] ";
+    std::shared_ptr<const IrcConfig> ircConfig = ircRelay::Config();
+
+    printf("%d rounds, callsign %s, message of %zu bytes\n\n", rounds, record.callsign.c_str(), message.size());
+    printf("before\n");
+    Measure("chat", rounds, [&](int) { sink = sink + ChatBefore(ircChannel, ircPrefix, record, message, false); });
+    Measure("action", rounds, [&](int) { sink = sink + ChatBefore(ircChannel, ircPrefix, record, message, true); });
+    Measure("join", rounds, [&](int) { sink = sink + JoinBefore(ircChannel, ircPrefix, record); });
+    Measure("part", rounds, [&](int) { sink = sink + PartBefore(ircChannel, ircPrefix, record); });
+
+    // the formatter writes into a pooled line, just like the event handlers do
+    bool clean = true;
+    auto format = [&](int kind) {
+        RelayLine* line = ircRelay::Allocate();
+        LineWriter writer(line->text, IRC_TEXT_SIZE);
+        if (kind == 0) ircRelay::FormatChat(writer, *ircConfig, player, message.c_str(), false);
+        else if (kind == 1) ircRelay::FormatChat(writer, *ircConfig, player, message.c_str(), true);
+        else if (kind == 2) ircRelay::FormatJoin(writer, *ircConfig, player);
+        else ircRelay::FormatPart(writer, *ircConfig, player);
+        sink = sink + writer.Length();
+        ircRelay::Release(line);
+    };
+    printf("\nafter\n");
+    clean = Measure("chat", rounds, [&](int) { format(0); }) && clean;
+    clean = Measure("action", rounds, [&](int) { format(1); }) && clean;
+    clean = Measure("join", rounds, [&](int) { format(2); }) && clean;
+    clean = Measure("part", rounds, [&](int) { format(3); }) && clean;
+
+    // the whole game thread side of an event, from the handler to the outbound queues
+    bz_ChatEventData_V2 chat;
+    chat.from = record.playerID;
+    chat.message = message;
+    bz_PlayerJoinPartEventData_V1 join(bz_ePlayerJoinEvent);
+    join.playerID = record.playerID;
+    join.record = &record;
+    bz_PlayerJoinPartEventData_V1 part(bz_ePlayerPartEvent);
+    part.playerID = record.playerID;
+    part.record = &record;
+    printf("\nevent handlers\n");
+    clean = Measure("chat event", rounds, [&](int) { plugin.Event(&chat); }) && clean;
+    clean = Measure("join and part", rounds, [&](int) { plugin.Event(&join); plugin.Event(&part); }) && clean;
+
+    plugin.Cleanup();
+    return clean ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2024 Dirk Sarodnick
+ * All rights reserved.
+ */
+
+// compares the line splitting of the original Receive with the IrcReader, in time and heap allocations per line,
+// both fed the same reads of a synthetic corpus
+#include "../ircRelay.cpp"
+
+#include <fstream>
+#include <new>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// only allocations of the thread that parses get counted
+static thread_local size_t allocations = 0;
+static volatile size_t sink;
+
+// the counting operators below are the replacements, gcc just cannot tell once they got inlined
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+    allocations++;
+    void* memory = malloc(size > 0 ? size : 1);
+    if (memory == NULL) throw std::bad_alloc();
+    return memory;
+}
+
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+void operator delete(void* memory, size_t size) noexcept {
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t size) noexcept {
+    free(memory);
+}
+
+// what Receive did before: a string per read, split with find, substr and erase, lines across reads get lost or cut
+static size_t ParseBefore(const std::string& stream, const std::vector<size_t>& reads, const std::unordered_set<std::string>* corpus) {
+    size_t lines = 0;
+    size_t offset = 0;
+    for (size_t i = 0; i < reads.size(); i++) {
+        std::string data = stream.substr(offset, reads[i]);
+        offset += reads[i];
+
+        size_t dataPos = 0;
+        std::string dataLine;
+        std::string dataDelimiter = "\r\n";
+        while ((dataPos = data.find(dataDelimiter)) != std::string::npos) {
+            dataLine = data.substr(0, dataPos);
+            data.erase(0, dataPos + dataDelimiter.length());
+            if (corpus == nullptr || corpus->count(dataLine) > 0) lines++;
+
+            if (dataLine.find("PRIVMSG", 0) != std::string::npos) {
+                std::string::size_type startpos = dataLine.find(":", 0);
+                std::string::size_type endpos = dataLine.find("!", 0);
+                std::string username = dataLine.substr(startpos + 1, endpos - 1);
+
+                startpos = dataLine.find(":", 1);
+                endpos = dataLine.size();
+                std::string message = dataLine.substr(startpos + 1, endpos);
+                sink = sink + username.size() + message.size();
+            }
+
+            if (dataLine.substr(0, 4) == "PING") {
+                std::string pongdata = dataLine.substr(5, dataLine.size());
+                std::string pong = "PONG " + pongdata;
+                sink = sink + pong.size();
+            }
+        }
+    }
+    return lines;
+}
+
+// what Receive does now: the reads go straight into the reader, which keeps incomplete lines
+static size_t ParseAfter(IrcReader& reader, const std::string& stream, const std::vector<size_t>& reads, const std::unordered_set<std::string>* corpus) {
+    size_t lines = 0;
+    size_t offset = 0;
+    IrcMessage message;
+    for (size_t i = 0; i < reads.size(); i++) {
+        size_t available;
+        char* space = reader.Space(available);
+        size_t length = reads[i] < available ? reads[i] : available;
+        memcpy(space, stream.data() + offset, length);
+        offset += length;
+        reader.Fill(length);
+
+        while (reader.Next(message)) {
+            if (corpus == nullptr || corpus->count(std::string(message.line.data, message.line.length)) > 0) lines++;
+            if (message.command.Equals("PRIVMSG")) sink = sink + message.nick.length + message.Text().length;
+            else if (message.command.Equals("PING")) sink = sink + message.Text().length;
+        }
+    }
+    return lines;
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "bench/corpus.irc";
+    int rounds = argc > 2 ? atoi(argv[2]) : 50;
+
+    // the corpus is repeated to about a megabyte, with the line endings of the wire
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Could not read the corpus %s\n", path);
+        return 1;
+    }
+    std::vector<std::string> corpus;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+        if (!line.empty()) corpus.push_back(line);
+    }
+    if (corpus.empty()) return 1;
+
+    std::string stream;
+    size_t total = 0;
+    while (stream.size() < 1024 * 1024) {
+        for (size_t i = 0; i < corpus.size(); i++) stream += corpus[i] + "\r\n";
+        total += corpus.size();
+    }
+
+    // reads end anywhere, like they do on a socket
+    std::minstd_rand random(1459);
+    std::uniform_int_distribution<size_t> readSize(1, 1024);
+    std::vector<size_t> reads;
+    for (size_t offset = 0; offset < stream.size(); ) {
+        size_t size = std::min(readSize(random), stream.size() - offset);
+        reads.push_back(size);
+        offset += size;
+    }
+
+    // a line only counts when it came out exactly as it was sent, this pass is not timed
+    std::unordered_set<std::string> intact(corpus.begin(), corpus.end());
+    IrcReader reader;
+    size_t beforeLines = ParseBefore(stream, reads, &intact);
+    size_t afterLines = ParseAfter(reader, stream, reads, &intact);
+
+    // neither are the passes that count the allocations
+    size_t counted = allocations;
+    ParseBefore(stream, reads, nullptr);
+    size_t beforeAllocations = allocations - counted;
+    counted = allocations;
+    ParseAfter(reader, stream, reads, nullptr);
+    size_t afterAllocations = allocations - counted;
+
+    double start = ircRelay::Now();
+    for (int i = 0; i < rounds; i++) ParseBefore(stream, reads, nullptr);
+    double before = (ircRelay::Now() - start) / rounds;
+
+    start = ircRelay::Now();
+    for (int i = 0; i < rounds; i++) ParseAfter(reader, stream, reads, nullptr);
+    double after = (ircRelay::Now() - start) / rounds;
+
+    printf("corpus: %zu lines, %zu bytes, %zu reads\n", total, stream.size(), reads.size());
+    printf("before: %8.1f ns/line, %7.1f MB/s, %6.2f allocations/line, %zu lines intact, %zu lost or cut\n", before * 1e9 / total, stream.size() / before / 1e6,
+        (double)beforeAllocations / total, beforeLines, total - beforeLines);
+    printf("after:  %8.1f ns/line, %7.1f MB/s, %6.2f allocations/line, %zu lines intact, %zu lost or cut\n", after * 1e9 / total, stream.size() / after / 1e6,
+        (double)afterAllocations / total, afterLines, total - afterLines);
+    return afterLines == total && afterAllocations == 0 ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2024 Dirk Sarodnick
+ * All rights reserved.
+ */
+
+// compares the scalar, sse2 and avx2 loops that look for control bytes and utf-8 in relayed text
+#include "../ircRelay.cpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+static volatile size_t sink;
+
+typedef size_t (*ScanPath)(const char* text, size_t length);
+
+static size_t Scalar(const char* text, size_t length) {
+    return IrcText::ScanScalar(text, length, 0);
+}
+
+#if defined(IRCRELAY_SSE2)
+static size_t Sse2(const char* text, size_t length) {
+    return IrcText::ScanScalar(text, length, IrcText::ScanSse2(text, length, 0));
+}
+#endif
+
+#if defined(IRCRELAY_AVX2)
+static size_t Avx2(const char* text, size_t length) {
+    return IrcText::ScanScalar(text, length, IrcText::ScanSse2(text, length, IrcText::ScanAvx2(text, length, 0)));
+}
+#endif
+
+static double Measure(ScanPath path, const std::vector<std::string>& lines, int rounds) {
+    double start = ircRelay::Now();
+    for (int round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < lines.size(); i++) sink = sink + path(lines[i].data(), lines[i].size());
+    }
+    return (ircRelay::Now() - start) / rounds / lines.size();
+}
+
+int main(int argc, char** argv) {
+    const char* path = argc > 1 ? argv[1] : "bench/corpus.irc";
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+
+    // the texts of the corpus lines, as they reach the scan
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Could not read the corpus %s\n", path);
+        return 1;
+    }
+    std::vector<std::string> corpus;
+    std::string line;
+    while (std::getline(file, line)) {
+        size_t text = line.find(" :", 1);
+        if (text != std::string::npos) corpus.push_back(line.substr(text + 2));
+    }
+    if (corpus.empty()) return 1;
+
+    std::string chat = "anyone up for a round of ctf on the new map later tonight?";
+    std::string longChat;
+    while (longChat.size() < 400) longChat += chat + " ";
+    std::string colored = longChat.substr(0, 396) + "\00304!\003";
+    std::string accented = longChat.substr(0, 200) + "caf\xc3\xa9 " + longChat.substr(0, 194);
+
+    struct Set {
+        const char* name;
+        std::vector<std::string> lines;
+    };
+    Set sets[] = {
+        { "corpus", corpus },
+        { "chat 57 bytes", std::vector<std::string>(1, chat) },
+        { "chat 400 bytes", std::vector<std::string>(1, longChat.substr(0, 400)) },
+        { "colour at 396", std::vector<std::string>(1, colored) },
+        { "utf-8 at 203", std::vector<std::string>(1, accented) }
+    };
+
+    struct Path {
+        const char* name;
+        ScanPath scan;
+    };
+    std::vector<Path> paths;
+    paths.push_back({ "scalar", Scalar });
+#if defined(IRCRELAY_SSE2)
+    paths.push_back({ "sse2", Sse2 });
+#endif
+#if defined(IRCRELAY_AVX2)
+#if defined(__GNUC__)
+    if (__builtin_cpu_supports("avx2")) paths.push_back({ "avx2", Avx2 });
+    else printf("avx2 is not supported by this cpu, its path is skipped\n");
+#else
+    paths.push_back({ "avx2", Avx2 });
+#endif
+#endif
+
+    // every path has to stop at the same byte as the scalar loop, before anything gets timed
+    bool agree = true;
+    for (const Set& set : sets) {
+        for (const std::string& text : set.lines) {
+            size_t expected = Scalar(text.data(), text.size());
+            for (const Path& scan : paths) {
+                if (scan.scan(text.data(), text.size()) != expected) {
+                    fprintf(stderr, "%s stops at another byte than scalar in %s\n", scan.name, set.name);
+                    agree = false;
+                }
+            }
+        }
+    }
+
+    printf("%-16s", "ns/line");
+    for (const Path& scan : paths) printf("%10s", scan.name);
+    printf("\n");
+    for (const Set& set : sets) {
+        int setRounds = set.lines.size() > 1 ? rounds / 100 + 1 : rounds * 10;
+        printf("%-16s", set.name);
+        for (const Path& scan : paths) printf("%10.1f", Measure(scan.scan, set.lines, setRounds) * 1e9);
+        printf("\n");
+    }
+    return agree ? 0 : 1;
+}
@@ -7,23 +7,60 @@
 #include "bzfsAPI.h"
 #include "plugin_utils.h"
 
-#include <regex>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define IRCRELAY_AVX2
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+// the avx2 loop gets built anyway, so the scan benchmark can compare it on any x86 build
+#include <immintrin.h>
+#define IRCRELAY_AVX2 __attribute__((target("avx2")))
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define IRCRELAY_SSE2
+#endif
+
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
 #include <io.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
-DWORD WINAPI WorkerThread(LPVOID lpParameter) { ircRelay::Worker(); };
+#define poll WSAPoll
+#define MSG_NOSIGNAL 0
+DWORD WINAPI WorkerThread(LPVOID lpParameter) { ircRelay::Worker(); return 0; };
+DWORD WINAPI ResolverThread(LPVOID lpParameter) { ircRelay::Resolver(); return 0; };
+DWORD WINAPI RecorderThread(LPVOID lpParameter) { ircRelay::Recorder(); return 0; };
+HANDLE threads[3];
+size_t threadCount;
 #else
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
-void* WorkerThread(void* t) { ircRelay::Worker(); }
+void* WorkerThread(void* t) { ircRelay::Worker(); return NULL; }
+void* ResolverThread(void* t) { ircRelay::Resolver(); return NULL; }
+void* RecorderThread(void* t) { ircRelay::Recorder(); return NULL; }
+void* ReplayThread(void* t) { IrcReplay* replay = (IrcReplay*)t; ircRelay::Replay(*replay); delete replay; return NULL; }
+pthread_t threads[3];
+size_t threadCount;
+pthread_t replayThread;
+bool replayStarted;
 #endif
 
 BZ_PLUGIN(ircRelay)
@@ -40,10 +77,21 @@ void ircRelay::Init(const char* config) {
     Register(bz_eRawChatMessageEvent);
     Register(bz_ePlayerJoinEvent);
     Register(bz_ePlayerPartEvent);
+    Register(bz_eTickEvent);
+    Register(bz_eReportFiledEvent);
+    Register(bz_ePlayerSpawnEvent);
+    Register(bz_ePlayerScoreChanged);
+    Register(bz_eTeamScoreChanged);
+    Register(bz_ePlayerDieEvent);
+    Register(bz_eCaptureEvent);
+    Register(bz_eGameStartEvent);
+    Register(bz_eGameEndEvent);
 
     // register config
     bz_registerCustomBZDBString("_ircAddress", "", 0, false);
     bz_registerCustomBZDBInt("_ircPort", 6667, 0, false);
+    bz_registerCustomBZDBBool("_ircTls", false, 0, false);
+    bz_registerCustomBZDBBool("_ircTlsVerify", true, 0, false);
     bz_registerCustomBZDBString("_ircChannel", "", 0, false);
     bz_registerCustomBZDBString("_ircNick", "", 0, false);
     bz_registerCustomBZDBString("_ircPass", "", 0, false);
@@ -51,143 +99,360 @@ void ircRelay::Init(const char* config) {
     bz_registerCustomBZDBString("_ircAuthPass", "", 0, false);
     bz_registerCustomBZDBString("_ircIgnore", "", 0, false);
     bz_registerCustomBZDBString("_ircPrefix", "", 0, false);
+    bz_registerCustomBZDBString("_ircFilter", "", 0, false);
+    bz_registerCustomBZDBString("_ircFilterFile", "", 0, false);
+    bz_registerCustomBZDBString("_ircFilterAction", "mask", 0, false);
+    bz_registerCustomBZDBString("_ircOverflow", "oldest", 0, false);
+    bz_registerCustomBZDBInt("_ircTickBudget", 5, 0, false);
+    bz_registerCustomBZDBInt("_ircBurst", 5, 0, false);
+    bz_registerCustomBZDBDouble("_ircRate", 1.0, 0, false);
+    bz_registerCustomBZDBString("_ircNetworks", "", 0, false);
+    bz_registerCustomBZDBString("_ircRoutes", "", 0, false);
+    bz_registerCustomBZDBString("_ircStatsFile", "", 0, false);
+    bz_registerCustomBZDBInt("_ircStatsInterval", 60, 0, false);
+    bz_registerCustomBZDBString("_ircSpool", "", 0, false);
+    bz_registerCustomBZDBInt("_ircSpoolSize", 1024, 0, false);
+    bz_registerCustomBZDBInt("_ircSpoolAge", 900, 0, false);
+    bz_registerCustomBZDBString("_ircCapture", "", 0, false);
+    bz_registerCustomBZDBString("_ircDigest", "", 0, false);
+    bz_registerCustomBZDBInt("_ircDigestWindow", 60, 0, false);
+    bz_registerCustomBZDBString("_ircHub", "", 0, false);
+    bz_registerCustomBZDBString("_ircHubTag", "", 0, false);
+    bz_registerCustomBZDBInt("_ircHistory", 50, 0, false);
+    bz_registerCustomBZDBInt("_ircHistoryJoin", 0, 0, false);
+
+    // register commands
+    bz_registerCustomSlashCommand("ircstats", this);
+    bz_registerCustomSlashCommand("ircreplay", this);
+    bz_registerCustomSlashCommand("irchistory", this);
+
+    Configure(nullptr, nullptr);
+
+    // pick up the players that are already there, e.g. after a reload of the plugin
+    bz_APIIntList* players = bz_newIntList();
+    if (bz_getPlayerIndexList(players)) {
+        for (unsigned int i = 0; i < players->size(); i++) {
+            int playerID = players->get(i);
+            bz_BasePlayerRecord* record = bz_getPlayerByIndex(playerID);
+            Enter(playerID, record);
+            if (record != NULL) bz_freePlayerRecord(record);
+        }
+    }
+    bz_deleteIntList(players);
+    Publish();
+
+    // nobody waits for history lines of a previous load
+    memset(replays, 0, sizeof(replays));
+    replaysPending = 0;
+
+    // prepare the shared lines and the connections
+    for (size_t i = 0; i < IRC_POOL_SIZE; i++) Release(&relayLines[i]);
+    for (size_t i = 0; i < IRC_NETWORK_SIZE; i++) connections[i] = new IrcConnection(i);
+
+    // a reloaded plugin starts over with running threads and its own connections
+    fc = false;
+    hubRole = HUB_DIRECT;
+
+    // make sure the ticks keep coming, so received messages get delivered even on an empty server
+    MaxWaitTime = 0.1f;
+
+    // c-ares counts its users, bzfs might already be one of them
+    if (ares_library_init(ARES_LIB_INIT_ALL) != ARES_SUCCESS) bz_debugMessage(1, "Initializing c-ares for the irc relay failed");
 
 #if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    // every thread is joined again in Cleanup, so none of them outlives the plugin
     DWORD thread;
-    CreateThread(0, 0, WorkerThread, NULL, 0, &thread);
+    LPTHREAD_START_ROUTINE routines[] = { WorkerThread, ResolverThread, RecorderThread };
+    threadCount = 0;
+    for (size_t i = 0; i < 3; i++) {
+        HANDLE handle = CreateThread(0, 0, routines[i], NULL, 0, &thread);
+        if (handle != NULL) threads[threadCount++] = handle;
+    }
 #else
-    pthread_t thread;
-    pthread_create(&thread, NULL, WorkerThread, NULL);
+    // prepare the pipe that wakes up the worker
+    if (pipe(wakeFds) == 0) {
+        fcntl(wakeFds[0], F_SETFL, O_NONBLOCK);
+        fcntl(wakeFds[1], F_SETFL, O_NONBLOCK);
+    }
+
+    // every thread is joined again in Cleanup, so none of them outlives the plugin
+    void* (*routines[])(void*) = { WorkerThread, ResolverThread, RecorderThread };
+    threadCount = 0;
+    for (size_t i = 0; i < 3; i++) {
+        if (pthread_create(&threads[threadCount], NULL, routines[i], NULL) == 0) threadCount++;
+    }
 #endif
 
     bz_debugMessage(2, "Initialized ircRelay custom plugin");
 }
 
-void ircRelay::Start() {
-    bz_debugMessage(2, "Starting ircRelay custom plugin");
+void ircRelay::Configure(const char* key, const char* value) {
+    // the changed variable might not be stored yet, so its new value is taken from the event
+    auto setting = [key, value](const char* name) -> std::string {
+        if (key != nullptr && strcmp(key, name) == 0) return value;
+        return bz_BZDBItemExists(name) ? bz_getBZDBString(name).c_str() : "";
+    };
 
-    // get config
-    std::string ircAddress;
-    int ircPort;
-    std::string ircChannel;
-    std::string ircNick;
-    std::string ircPass;
-    std::string ircAuthType;
-    std::string ircAuthPass;
-    std::string ircPrefix;
-    if (bz_BZDBItemExists("_ircAddress")) ircAddress = bz_getBZDBString("_ircAddress"); else { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because _ircAddress does not exist"); return; }
-    if (bz_BZDBItemExists("_ircPort")) ircPort = bz_getBZDBInt("_ircPort"); else ircPort = 6667;
-    if (bz_BZDBItemExists("_ircChannel")) ircChannel = bz_getBZDBString("_ircChannel"); else { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because _ircChannel does not exist"); return; }
-    if (bz_BZDBItemExists("_ircNick")) ircNick = bz_getBZDBString("_ircNick"); else { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because _ircNick does not exist"); return; }
-    if (bz_BZDBItemExists("_ircPass")) ircPass = bz_getBZDBString("_ircPass"); else ircPass = "";
-    if (bz_BZDBItemExists("_ircAuthType")) ircAuthType = bz_getBZDBString("_ircAuthType"); else ircAuthType = "";
-    if (bz_BZDBItemExists("_ircAuthPass")) ircAuthPass = bz_getBZDBString("_ircAuthPass"); else ircAuthPass = "";
-    if (bz_BZDBItemExists("_ircPrefix")) ircPrefix = bz_getBZDBString("_ircPrefix"); else ircPrefix = "";
-    if (ircAddress == "") { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because address is still empty"); return; }
-    if (ircChannel == "") { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because channel is still empty"); return; }
-    if (ircNick == "") { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because nick is still empty"); return; }
-    if (fd != 0) { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because its already running"); return; }
-
-    // prepare socket
-    fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd == 0) {
-        std::string debugMessage = "Connection to irc server " + ircAddress + " failed, because creating the socket failed";
-        bz_debugMessage(1, debugMessage.c_str());
-        return;
+    // splits a comma separated list and skips empty entries
+    auto split = [](const std::string& list) -> std::vector<std::string> {
+        std::vector<std::string> entries;
+        size_t entryStart = 0;
+        while (entryStart < list.length()) {
+            size_t entryEnd = list.find(',', entryStart);
+            if (entryEnd == std::string::npos) entryEnd = list.length();
+            if (entryEnd > entryStart) entries.push_back(list.substr(entryStart, entryEnd - entryStart));
+            entryStart = entryEnd + 1;
+        }
+        return entries;
+    };
+
+    std::shared_ptr<IrcConfig> next = std::make_shared<IrcConfig>();
+    next->nick = setting("_ircNick");
+    next->prefix = setting("_ircPrefix");
+
+    // the main network is configured by the classic variables
+    IrcNetwork main;
+    main.name = "main";
+    main.address = setting("_ircAddress");
+    main.port = atoi(setting("_ircPort").c_str());
+    if (main.port <= 0) main.port = 6667;
+    main.tls = setting("_ircTls") == "1" || setting("_ircTls") == "true";
+    main.pass = setting("_ircPass");
+    main.authType = setting("_ircAuthType");
+    main.authPass = setting("_ircAuthPass");
+    next->networks.push_back(main);
+
+    // additional networks look like name=host:port, a port starting with + uses tls
+    std::vector<std::string> ircNetworks = split(setting("_ircNetworks"));
+    for (size_t i = 0; i < ircNetworks.size() && next->networks.size() < IRC_NETWORK_SIZE; i++) {
+        size_t namePos = ircNetworks[i].find('=');
+        if (namePos == std::string::npos) continue;
+
+        IrcNetwork network;
+        network.name = ircNetworks[i].substr(0, namePos);
+        network.address = ircNetworks[i].substr(namePos + 1);
+        network.port = 6667;
+        network.tls = false;
+        size_t portPos = network.address.rfind(':');
+        if (portPos != std::string::npos) {
+            network.tls = network.address.compare(portPos + 1, 1, "+") == 0;
+            network.port = atoi(network.address.substr(portPos + 1).c_str());
+            network.address = network.address.substr(0, portPos);
+        }
+        next->networks.push_back(network);
+    }
+
+    // routes look like event=channel or event=network/channel, without any everything goes to _ircChannel
+    std::string ircChannel = setting("_ircChannel");
+    std::vector<std::string> ircRoutes = split(setting("_ircRoutes"));
+    if (ircRoutes.size() == 0 && ircChannel != "") {
+        ircRoutes.push_back("chat=" + ircChannel);
+        ircRoutes.push_back("join=" + ircChannel);
+        ircRoutes.push_back("part=" + ircChannel);
+        ircRoutes.push_back("irc=" + ircChannel);
+        ircRoutes.push_back("game=" + ircChannel);
+    }
+    next->routed = 0;
+    for (size_t i = 0; i < ircRoutes.size(); i++) {
+        size_t eventPos = ircRoutes[i].find('=');
+        if (eventPos == std::string::npos) continue;
+
+        IrcRoute route;
+        std::string event = ircRoutes[i].substr(0, eventPos);
+        if (event == "chat") route.event = RELAY_CHAT;
+        else if (event == "team") route.event = RELAY_TEAM;
+        else if (event == "admin") route.event = RELAY_ADMIN;
+        else if (event == "join") route.event = RELAY_JOIN;
+        else if (event == "part") route.event = RELAY_PART;
+        else if (event == "irc") route.event = RELAY_IRC;
+        else if (event == "game") route.event = RELAY_GAME;
+        else continue;
+
+        route.network = 0;
+        route.channel = ircRoutes[i].substr(eventPos + 1);
+        size_t networkPos = route.channel.find('/');
+        if (networkPos != std::string::npos) {
+            std::string network = route.channel.substr(0, networkPos);
+            route.channel = route.channel.substr(networkPos + 1);
+            route.network = next->networks.size();
+            for (size_t j = 0; j < next->networks.size(); j++) {
+                if (next->networks[j].name == network) route.network = j;
+            }
+            if (route.network == next->networks.size()) continue;
+        }
+        if (route.channel.size() > 0 && route.channel[0] == '#') route.channel = route.channel.substr(1);
+        if (route.channel == "" || route.channel.size() >= IRC_CHANNEL_SIZE) continue;
+
+        // every network joins the channels it has routes for
+        IrcNetwork& network = next->networks[route.network];
+        std::vector<std::string>& channels = route.event == RELAY_IRC ? network.relayed : network.channels;
+        if (std::find(channels.begin(), channels.end(), route.channel) == channels.end()) channels.push_back(route.channel);
+        if (route.event == RELAY_IRC && std::find(network.channels.begin(), network.channels.end(), route.channel) == network.channels.end()) network.channels.push_back(route.channel);
+
+        next->routes.push_back(route);
+        next->routed |= 1 << route.event;
     }
 
-    // prepare connection
-    struct sockaddr_in dest_addr;
-    memset(&dest_addr, 0, sizeof(dest_addr));
-    dest_addr.sin_family = AF_INET;
-    dest_addr.sin_port = htons(ircPort);
+    // split the ignore list once, so receiving only needs a lookup
+    std::vector<std::string> ircIgnores = split(setting("_ircIgnore"));
+    for (size_t i = 0; i < ircIgnores.size(); i++) next->ignores.Add(ircIgnores[i]);
 
-    if (std::regex_match(ircAddress, rgx)) {
-        bz_debugMessage(2, "Given irc server address looks like an IP");
-        dest_addr.sin_addr.s_addr = inet_addr(ircAddress.c_str());
+    // the filter only gets compiled again when its patterns changed, including the file
+    std::string ircFilter = setting("_ircFilter");
+    std::string ircFilterFile = setting("_ircFilterFile");
+    std::string ircFilterAction = setting("_ircFilterAction");
+    struct stat filterInfo;
+    next->filterSource = ircFilter + "\n" + ircFilterFile + "\n" + ircFilterAction;
+    if (ircFilterFile != "" && stat(ircFilterFile.c_str(), &filterInfo) == 0) next->filterSource += "\n" + std::to_string((long long)filterInfo.st_mtime) + "\n" + std::to_string((long long)filterInfo.st_size);
+
+    std::shared_ptr<const IrcConfig> previous = Config();
+    if (previous && previous->filterSource == next->filterSource) {
+        next->filter = previous->filter;
     }
     else {
-        bz_debugMessage(2, "Given irc server address looks like a Hostname");
-        struct hostent* dest_host = gethostbyname(ircAddress.c_str());
-        if (!dest_host) {
-            std::string debugMessage = "Could not resolve irc server " + ircAddress;
+        // patterns look like word or *part*, a pattern=replacement gets rewritten instead
+        std::shared_ptr<IrcFilter> filter = std::make_shared<IrcFilter>();
+        FilterAction action = ircFilterAction == "drop" ? FILTER_DROP : FILTER_MASK;
+        auto add = [&filter, action](const std::string& entry) {
+            size_t replacementPos = entry.find('=');
+            if (replacementPos != std::string::npos) filter->Add(entry.substr(0, replacementPos), FILTER_REWRITE, entry.substr(replacementPos + 1));
+            else filter->Add(entry, action, "");
+        };
+
+        std::vector<std::string> ircFilters = split(ircFilter);
+        for (size_t i = 0; i < ircFilters.size(); i++) add(ircFilters[i]);
+
+        // the file has a pattern per line, lines starting with # are comments
+        FILE* file = ircFilterFile != "" ? fopen(ircFilterFile.c_str(), "r") : NULL;
+        if (ircFilterFile != "" && file == NULL) {
+            std::string debugMessage = "Reading irc filter file " + ircFilterFile + " failed";
             bz_debugMessage(1, debugMessage.c_str());
-            fd = 0;
-            return;
         }
-        dest_addr.sin_addr = *((struct in_addr*)dest_host->h_addr);
-    }
-    memset(&(dest_addr.sin_zero), '\0', 8);
+        if (file != NULL) {
+            char entry[IRC_LINE_SIZE];
+            while (fgets(entry, sizeof(entry), file) != NULL) {
+                size_t length = strcspn(entry, "\r\n");
+                if (length == 0 || entry[0] == '#') continue;
+                add(std::string(entry, length));
+            }
+            fclose(file);
+        }
 
-    // connect to server
-    std::string debugMessage = "Connecting to irc server " + ircAddress;
-    bz_debugMessage(1, debugMessage.c_str());
-    if (connect(fd, (struct sockaddr*)&dest_addr, sizeof(struct sockaddr)) < 0) {
-        std::string debugMessage = "Connection to irc server " + ircAddress + " failed";
-        bz_debugMessage(1, debugMessage.c_str());
-        fd = 0;
-        return;
+        filter->Compile();
+        next->filter = filter;
+        std::string debugMessage = "Compiled irc filter with " + std::to_string(filter->Size()) + " patterns";
+        bz_debugMessage(3, debugMessage.c_str());
     }
-    Wait(0, 10);
 
-    // send pass
-    if (ircPass != "") {
-        Send("PASS " + ircPass, 3);
-    }
+    std::string ircOverflow = setting("_ircOverflow");
+    next->overflow = OVERFLOW_OLDEST;
+    if (ircOverflow == "newest") next->overflow = OVERFLOW_NEWEST;
+    if (ircOverflow == "coalesce") next->overflow = OVERFLOW_COALESCE;
 
-    // send nick
-    Send("NICK " + ircNick, 3);
+    std::string ircTickBudget = setting("_ircTickBudget");
+    next->tickBudget = ircTickBudget == "" ? 5 : atoi(ircTickBudget.c_str());
+    if (next->tickBudget < 1) next->tickBudget = 1;
 
-    // send user
-    Send("USER ircrelay 0 * :BZFlag ircRelay", 3);
+    std::string ircBurst = setting("_ircBurst");
+    next->burst = ircBurst == "" ? 5 : atoi(ircBurst.c_str());
+    if (next->burst < 1) next->burst = 1;
+    std::string ircRate = setting("_ircRate");
+    next->rate = ircRate == "" ? 1.0 : atof(ircRate.c_str());
+    if (next->rate <= 0) next->rate = 0.1;
 
-    // receive until PING
-    Receive("PING");
+    next->tlsVerify = setting("_ircTlsVerify") != "0" && setting("_ircTlsVerify") != "false";
 
-    // give the server an additional second
-    Wait(1, 0);
+    next->statsFile = setting("_ircStatsFile");
+    std::string ircStatsInterval = setting("_ircStatsInterval");
+    next->statsInterval = ircStatsInterval == "" ? 60 : atoi(ircStatsInterval.c_str());
+    if (next->statsInterval < 1) next->statsInterval = 1;
 
-    // send auth
-    if (ircAuthType == "AuthServ") {
-        Send("PRIVMSG AuthServ :AUTH " + ircNick + " " + ircAuthPass, 3);
-        Receive("");
-    }
-    if (ircAuthType == "NickServ") {
-        Send("PRIVMSG NickServ :IDENTIFY " + ircAuthPass, 3);
-        Receive("");
-    }
-    if (ircAuthType == "Q") {
-        Send("PRIVMSG Q@CServe.quakenet.org :AUTH " + ircNick + " " + ircAuthPass, 3);
-        Receive("");
-    }
+    next->spool = setting("_ircSpool");
+    std::string ircSpoolSize = setting("_ircSpoolSize");
+    next->spoolSize = ircSpoolSize == "" ? 1024 : atoi(ircSpoolSize.c_str());
+    if (next->spoolSize < 16) next->spoolSize = 16;
+    std::string ircSpoolAge = setting("_ircSpoolAge");
+    next->spoolAge = ircSpoolAge == "" ? 900 : atoi(ircSpoolAge.c_str());
 
-    // send join
-    Send("JOIN #" + ircChannel, 3);
+    next->capture = setting("_ircCapture");
 
-    bz_debugMessage(2, "Started ircRelay custom plugin");
-}
+    // kills are summarized per window, captures and the match state are relayed as they happen
+    std::vector<std::string> ircDigest = split(setting("_ircDigest"));
+    next->digest = 0;
+    for (size_t i = 0; i < ircDigest.size(); i++) {
+        if (ircDigest[i] == "kills") next->digest |= 1 << DIGEST_KILL;
+        else if (ircDigest[i] == "captures") next->digest |= 1 << DIGEST_CAPTURE;
+        else if (ircDigest[i] == "matches") next->digest |= (1 << DIGEST_START) | (1 << DIGEST_END);
+    }
+    std::string ircDigestWindow = setting("_ircDigestWindow");
+    next->digestWindow = ircDigestWindow == "" ? 60 : atoi(ircDigestWindow.c_str());
+    if (next->digestWindow < 5) next->digestWindow = 5;
 
-void ircRelay::Stop() {
-    bz_debugMessage(2, "Stopping ircRelay custom plugin");
+    // servers sharing a hub tell their lines apart by the tag, which defaults to the port
+    next->hub = setting("_ircHub");
+    next->hubTag = setting("_ircHubTag");
+    if (next->hubTag == "") next->hubTag = std::to_string(bz_getPublicPort());
+    if (next->hubTag.size() > 255) next->hubTag = next->hubTag.substr(0, 255);
+    if (next->hub != "" && next->prefix == "") next->prefix = "[" + next->hubTag + "] ";
 
-    // close socket
-    close(fd);
-    fd = 0;
+    // joining players get at most a page, the rest is available through /irchistory
+    std::string ircHistory = setting("_ircHistory");
+    int historySize = ircHistory == "" ? 50 : atoi(ircHistory.c_str());
+    next->history = historySize < 0 ? 0 : historySize > IRC_HISTORY_SIZE ? IRC_HISTORY_SIZE : historySize;
+    int historyJoin = atoi(setting("_ircHistoryJoin").c_str());
+    next->historyJoin = historyJoin < 0 ? 0 : historyJoin > IRC_HISTORY_PAGE ? IRC_HISTORY_PAGE : historyJoin;
 
-    bz_debugMessage(2, "Stopped ircRelay custom plugin");
+    std::atomic_store(&config, std::shared_ptr<const IrcConfig>(next));
+}
+
+std::shared_ptr<const IrcConfig> ircRelay::Config() {
+    return std::atomic_load(&config);
 }
 
 void ircRelay::Cleanup() {
     bz_debugMessage(2, "Cleaning ircRelay custom plugin");
 
-    // clean up stuff
+    // stop the threads and wait for all of them, the worker closes the connections and the resolver cancels its lookup
     fc = true;
-    Stop();
+    Wake();
+    {
+        std::lock_guard<std::mutex> lock(resolveMutex);
+    }
+    resolveSignal.notify_all();
+    {
+        std::lock_guard<std::mutex> lock(captureMutex);
+    }
+    captureSignal.notify_all();
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    for (size_t i = 0; i < threadCount; i++) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+#else
+    for (size_t i = 0; i < threadCount; i++) pthread_join(threads[i], NULL);
+    if (replayStarted) pthread_join(replayThread, NULL);
+    replayStarted = false;
+    close(wakeFds[0]);
+    close(wakeFds[1]);
+    wakeFds[0] = 0;
+    wakeFds[1] = 0;
+    woken = false;
+#endif
+    threadCount = 0;
+    ares_library_cleanup();
     Flush();
 
+    for (size_t i = 0; i < IRC_NETWORK_SIZE; i++) {
+        delete connections[i];
+        connections[i] = nullptr;
+    }
+    history.Resize(0);
+
     // deregister config
     bz_removeCustomBZDBVariable("_ircAddress");
     bz_removeCustomBZDBVariable("_ircPort");
+    bz_removeCustomBZDBVariable("_ircTls");
+    bz_removeCustomBZDBVariable("_ircTlsVerify");
     bz_removeCustomBZDBVariable("_ircChannel");
     bz_removeCustomBZDBVariable("_ircNick");
     bz_removeCustomBZDBVariable("_ircPass");
@@ -195,17 +460,68 @@ void ircRelay::Cleanup() {
     bz_removeCustomBZDBVariable("_ircAuthPass");
     bz_removeCustomBZDBVariable("_ircIgnore");
     bz_removeCustomBZDBVariable("_ircPrefix");
+    bz_removeCustomBZDBVariable("_ircFilter");
+    bz_removeCustomBZDBVariable("_ircFilterFile");
+    bz_removeCustomBZDBVariable("_ircFilterAction");
+    bz_removeCustomBZDBVariable("_ircOverflow");
+    bz_removeCustomBZDBVariable("_ircTickBudget");
+    bz_removeCustomBZDBVariable("_ircBurst");
+    bz_removeCustomBZDBVariable("_ircRate");
+    bz_removeCustomBZDBVariable("_ircNetworks");
+    bz_removeCustomBZDBVariable("_ircRoutes");
+    bz_removeCustomBZDBVariable("_ircStatsFile");
+    bz_removeCustomBZDBVariable("_ircStatsInterval");
+    bz_removeCustomBZDBVariable("_ircSpool");
+    bz_removeCustomBZDBVariable("_ircSpoolSize");
+    bz_removeCustomBZDBVariable("_ircSpoolAge");
+    bz_removeCustomBZDBVariable("_ircCapture");
+    bz_removeCustomBZDBVariable("_ircDigest");
+    bz_removeCustomBZDBVariable("_ircDigestWindow");
+    bz_removeCustomBZDBVariable("_ircHub");
+    bz_removeCustomBZDBVariable("_ircHubTag");
+    bz_removeCustomBZDBVariable("_ircHistory");
+    bz_removeCustomBZDBVariable("_ircHistoryJoin");
+
+    // deregister commands
+    bz_removeCustomSlashCommand("ircstats");
+    bz_removeCustomSlashCommand("ircreplay");
+    bz_removeCustomSlashCommand("irchistory");
 
     bz_debugMessage(2, "Cleaned ircRelay custom plugin");
 }
 
 void ircRelay::Event(bz_EventData* eventData) {
+    // measure how long the game thread is held up by every kind of event
+    double start = Now();
+    HandleEvent(eventData);
+
+    GameEvent event;
+    switch (eventData->eventType) {
+        case bz_eBZDBChange: event = GAME_BZDB; break;
+        case bz_eRawChatMessageEvent: event = GAME_CHAT; break;
+        case bz_ePlayerJoinEvent: event = GAME_JOIN; break;
+        case bz_ePlayerPartEvent: event = GAME_PART; break;
+        case bz_eReportFiledEvent: event = GAME_REPORT; break;
+        case bz_ePlayerSpawnEvent: event = GAME_SPAWN; break;
+        case bz_ePlayerScoreChanged: event = GAME_SCORE; break;
+        case bz_eTeamScoreChanged: event = GAME_SCORE; break;
+        case bz_ePlayerDieEvent: event = GAME_DIE; break;
+        case bz_eCaptureEvent: event = GAME_CAPTURE; break;
+        case bz_eGameStartEvent: event = GAME_MATCH; break;
+        case bz_eGameEndEvent: event = GAME_MATCH; break;
+        case bz_eTickEvent: event = GAME_TICK; break;
+        default: return;
+    }
+    metrics.gameStall[event].Record(Now() - start);
+}
+
+void ircRelay::HandleEvent(bz_EventData* eventData) {
     switch (eventData->eventType) {
         case bz_eBZDBChange:
         {
             // This event is called each time a BZDB variable is changed
             bz_BZDBChangeData_V1* data = (bz_BZDBChangeData_V1*)eventData;
-            if (fd == 0) break;
+            if (strncmp(data->key.c_str(), "_irc", 4) != 0) break;
 
             // Data
             // ----
@@ -213,14 +529,16 @@ void ircRelay::Event(bz_EventData* eventData) {
             // (bz_ApiString) value     - What the variable was changed too
             // (double)       eventTime - This value is the local server time of the event.
 
-            // restart on changing address or channel
-            if (data->key == "_ircAddress" || data->key == "_ircPort" || data->key == "_ircChannel" || data->key == "_ircPass" || data->key == "_ircAuth") {
-                Stop();
-            }
+            std::shared_ptr<const IrcConfig> previous = Config();
+            Configure(data->key.c_str(), data->value.c_str());
+            std::shared_ptr<const IrcConfig> current = Config();
+
+            // the worker compares the new config with the one each connection runs on
+            for (size_t i = 0; i < IRC_NETWORK_SIZE; i++) connections[i]->Reconfigure();
 
             // rename on changing nick
-            if (data->key == "_ircNick") {
-                Send("NICK " + (std::string)data->value, 3);
+            if (current->nick != previous->nick) {
+                Queue("NICK " + current->nick);
             }
         }
         break;
@@ -228,7 +546,6 @@ void ircRelay::Event(bz_EventData* eventData) {
         {
             // This event is called for each chat message the server receives. It is called before any filtering is done.
             bz_ChatEventData_V2* data = (bz_ChatEventData_V2*)eventData;
-            if (fd == 0) break;
 
             // Data
             // ----
@@ -239,54 +556,55 @@ void ircRelay::Event(bz_EventData* eventData) {
             // (bz_eMessageType) messageType - The type of message being sent
             // (double)          eventTime   - The time of the event.
 
-            std::string ircChannel = bz_BZDBItemExists("_ircChannel") ? bz_getBZDBString("_ircChannel") : "";
-            std::string ircPrefix = bz_BZDBItemExists("_ircPrefix") ? bz_getBZDBString("_ircPrefix") : "";
-            if (ircChannel == "") break;
-
-            bz_BasePlayerRecord* speaker = bz_getPlayerByIndex(data->from);
-            if (data->to == BZ_ALLUSERS && speaker != NULL) {
-                std::string message = data->message;
-                std::string player = speaker->callsign;
-                int team = speaker->team;
-                std::string colorcode;
-
-                if (message.length() > 0 && message.substr(0, 1) != "/") {//no slash commands
-                    if (team == 0)
-                        colorcode = "\00307"; // rogue
-
-                    else if (team == 1)
-                        colorcode = "\00304"; // red team
-
-                    else if (team == 2)
-                        colorcode = "\00303"; // green team
-
-                    else if (team == 3)
-                        colorcode = "\00302"; // blue team
-
-                    else if (team == 4)
-                        colorcode = "\00306"; // purple team
-
-                    else if (team == 5)
-                        colorcode = "\00310"; // observer
-
-                    else if (team == 6)
-                        colorcode = "\00314"; // rabbit
-
-                    if (message != "bzadminping") {// if message is not a bzadminping
-                        
-                        if (data->messageType == eActionMessage) {
-                            std::string subtotal = colorcode + player + " " + message;
-                            std::string total = "PRIVMSG #" + ircChannel + " :\001ACTION " + ircPrefix + subtotal + "\001";
-                            Send(total, 3);
-                        }
-                        else {
-                            std::string subtotal = colorcode + player + ": " + "\017" + message;
-                            std::string total = "PRIVMSG #" + ircChannel + " :" + ircPrefix + subtotal;
-                            Send(total, 3);
-                        }
-
-                        break;
+            // public chat, team chat and the admin channel have their own routes
+            RelayEvent event = RELAY_CHAT;
+            if (data->to == BZ_NULLUSER && data->team == eAdministrators) event = RELAY_ADMIN;
+            else if (data->to == BZ_NULLUSER && data->team != eNoTeam) event = RELAY_TEAM;
+            else if (data->to != BZ_ALLUSERS) break;
+
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            if ((ircConfig->routed & (1 << event)) == 0) break;
+
+            const RosterEntry* speaker = Player(data->from);
+            if (speaker != nullptr) {
+                const char* message = data->message.c_str();
+
+                // no slash commands and no bzadminping
+                if (message[0] != '\0' && message[0] != '/' && strcmp(message, "bzadminping") != 0) {
+                    // players can not send control bytes or colours to irc
+                    std::string sanitized;
+                    if (IrcText::FromGame(message, strlen(message), sanitized)) {
+                        if (sanitized.empty()) break;
+                        message = sanitized.c_str();
                     }
+
+                    if (capturing) {
+                        CaptureKind kind = event != RELAY_CHAT ? CAPTURE_TEAM : data->messageType == eActionMessage ? CAPTURE_ACTION : CAPTURE_CHAT;
+                        Capture(kind, 0, speaker->team, data->team, speaker->callsign, message, strlen(message));
+                    }
+
+                    std::string filtered;
+                    FilterAction action = ircConfig->filter->Empty() ? FILTER_PASS : ircConfig->filter->Apply(message, strlen(message), filtered);
+                    if (action == FILTER_DROP) break;
+                    if (action != FILTER_PASS) message = filtered.c_str();
+
+                    // only public chat is kept, everybody may read the history
+                    if (event == RELAY_CHAT) {
+                        bool action = data->messageType == eActionMessage;
+                        char speakerPrefix[BZ_CALLSIGN_SIZE + 4];
+                        LineWriter prefixWriter(speakerPrefix, sizeof(speakerPrefix) - 1);
+                        prefixWriter.Append(action ? "* " : "").Append(speaker->callsign).Append(action ? " " : ": ");
+                        speakerPrefix[prefixWriter.Length()] = '\0';
+                        history.Add(HISTORY_GAME, speakerPrefix, message, strlen(message));
+                    }
+
+                    RelayLine* line = Allocate();
+                    if (line == nullptr) break;
+
+                    LineWriter writer(line->text, IRC_TEXT_SIZE);
+                    if (event == RELAY_CHAT) FormatChat(writer, *ircConfig, *speaker, message, data->messageType == eActionMessage);
+                    else FormatTeam(writer, *ircConfig, *speaker, data->team, message);
+                    Relay(*ircConfig, event, line, OUTBOUND_CHAT, speaker->callsign, writer.Length());
                 }
             }
         }
@@ -295,7 +613,6 @@ void ircRelay::Event(bz_EventData* eventData) {
         case bz_ePlayerJoinEvent: {
             // This event is called each time a player joins the game
             bz_PlayerJoinPartEventData_V1* data = (bz_PlayerJoinPartEventData_V1*)eventData;
-            if (fd == 0) break;
 
             // Data
             // ----
@@ -303,56 +620,24 @@ void ircRelay::Event(bz_EventData* eventData) {
             // (bz_BasePlayerRecord*) record    - The player record for the joining player
             // (double)               eventTime - Time of event.
 
-            std::string ircChannel = bz_BZDBItemExists("_ircChannel") ? bz_getBZDBString("_ircChannel") : "";
-            std::string ircPrefix = bz_BZDBItemExists("_ircPrefix") ? bz_getBZDBString("_ircPrefix") : "";
-            if (ircChannel == "") break;
-
-            bz_BasePlayerRecord* joiner = data->record;
-            if (joiner != NULL) {
-                std::string callsign = joiner->callsign;
-                std::string ip = joiner->ipAddress;
-                int team = joiner->team;
-                std::string colorcode;
-                std::string player_team;
-
-                if (team == 0) {
-                    colorcode = "\00307"; // rogue
-                    player_team = "rogue";
-                }
-                else if (team == 1) {
-                    colorcode = "\00304"; // red team
-                    player_team = "red player";
-                }
-                else if (team == 2) {
-                    colorcode = "\00303"; // green team
-                    player_team = "green player";
-                }
-                else if (team == 3) {
-                    colorcode = "\00302"; // blue team
-                    player_team = "blue player";
-                }
-                else if (team == 4) {
-                    colorcode = "\00306"; // purple team
-                    player_team = "purple player";
-                }
-                else if (team == 5) {
-                    colorcode = "\00310"; // observer
-                    player_team = "observer";
-                }
-                else if (team == 6) {
-                    colorcode = "\00314"; // rabbit
-                    player_team = "rabbit";
-                }
-                else {
-                    colorcode = "\017";
-                }
-                if (callsign != "") {//send it only it is not a list server ping
-                    std::string subtotal = colorcode + callsign + "\017" + " joined as a " + player_team + " from " + ip;
-                    std::string total = "PRIVMSG #" + ircChannel + " :" + ircPrefix + subtotal;
+            Enter(data->playerID, data->record);
 
-                    Send(total, 3);
-                    break;
-                }
+            // catch the new player up on the conversation, a few lines per tick
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            const RosterEntry* joiner = Player(data->playerID);
+            if (ircConfig->historyJoin > 0 && joiner != nullptr && joiner->callsign[0] != '\0') Recall(data->playerID, 1, ircConfig->historyJoin);
+
+            if ((ircConfig->routed & (1 << RELAY_JOIN)) == 0) break;
+
+            if (joiner != nullptr && joiner->callsign[0] != '\0') {//send it only it is not a list server ping
+                if (capturing) Capture(CAPTURE_JOIN, 0, joiner->team, eNoTeam, joiner->callsign, joiner->ip, strlen(joiner->ip));
+
+                RelayLine* line = Allocate();
+                if (line == nullptr) break;
+
+                LineWriter writer(line->text, IRC_TEXT_SIZE);
+                FormatJoin(writer, *ircConfig, *joiner);
+                Relay(*ircConfig, RELAY_JOIN, line, OUTBOUND_JOIN, joiner->callsign, writer.Length());
             }
         }
         break;
@@ -360,7 +645,6 @@ void ircRelay::Event(bz_EventData* eventData) {
         case bz_ePlayerPartEvent: {
             // This event is called each time a player leaves a game
             bz_PlayerJoinPartEventData_V1* data = (bz_PlayerJoinPartEventData_V1*)eventData;
-            if (fd == 0) break;
 
             // Data
             // ----
@@ -369,190 +653,3633 @@ void ircRelay::Event(bz_EventData* eventData) {
             // (bz_ApiString)         reason    - The reason for leaving, such as a kick or a ban
             // (double)               eventTime - Time of event.
 
-            std::string ircChannel = bz_BZDBItemExists("_ircChannel") ? bz_getBZDBString("_ircChannel") : "";
-            std::string ircPrefix = bz_BZDBItemExists("_ircPrefix") ? bz_getBZDBString("_ircPrefix") : "";
-            if (ircChannel == "") break;
+            // the player is gone from the roster after this, whether the part gets relayed or not
+            if (data->playerID < 0 || data->playerID >= IRC_ROSTER_SIZE) break;
+            RosterEntry* leaver = &roster[data->playerID];
+            if (!leaver->active) Enter(data->playerID, data->record);
+            if (!leaver->active) break;
+            leaver->active = false;
+            rosterChanged = true;
+            Recall(data->playerID, 0, 0);
 
-            bz_BasePlayerRecord* leaver = data->record;
-            if (leaver != NULL) {
-                std::string callsign = leaver->callsign;
-                int team = leaver->team;
-                std::string colorcode;
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            if ((ircConfig->routed & (1 << RELAY_PART)) == 0) break;
 
-                if (team == 0)
-                    colorcode = "\00307"; // rogue
+            if (leaver->callsign[0] != '\0') {//send it only it is not a list server ping
+                if (capturing) Capture(CAPTURE_PART, 0, leaver->team, eNoTeam, leaver->callsign, "", 0);
+
+                RelayLine* line = Allocate();
+                if (line == nullptr) break;
+
+                LineWriter writer(line->text, IRC_TEXT_SIZE);
+                FormatPart(writer, *ircConfig, *leaver);
+                Relay(*ircConfig, RELAY_PART, line, OUTBOUND_PART, leaver->callsign, writer.Length());
+            }
+        }
+        break;
 
-                else if (team == 1)
-                    colorcode = "\00304"; // red team
+        case bz_eReportFiledEvent: {
+            // This event is called when a player files a report
+            bz_ReportFiledEventData_V1* data = (bz_ReportFiledEventData_V1*)eventData;
 
-                else if (team == 2)
-                    colorcode = "\00303"; // green team
+            // Data
+            // ----
+            // (int)          playerID  - The player that filed the report
+            // (bz_ApiString) message   - The content of the report
+            // (double)       eventTime - Time of event.
 
-                else if (team == 3)
-                    colorcode = "\00302"; // blue team
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            if ((ircConfig->routed & (1 << RELAY_ADMIN)) == 0) break;
 
-                else if (team == 4)
-                    colorcode = "\00306"; // purple team
+            const RosterEntry* reporter = Player(data->playerID);
+            if (reporter != nullptr) {
+                const char* message = data->message.c_str();
+                std::string sanitized;
+                if (IrcText::FromGame(message, data->message.size(), sanitized)) message = sanitized.c_str();
+                if (capturing) Capture(CAPTURE_REPORT, 0, reporter->team, eNoTeam, reporter->callsign, message, strlen(message));
 
-                else if (team == 5)
-                    colorcode = "\00310"; // observer
+                RelayLine* line = Allocate();
+                if (line == nullptr) break;
 
-                else if (team == 6)
-                    colorcode = "\00314"; // rabbit
+                LineWriter writer(line->text, IRC_TEXT_SIZE);
+                FormatReport(writer, *ircConfig, *reporter, message);
+                Relay(*ircConfig, RELAY_ADMIN, line, OUTBOUND_CHAT, reporter->callsign, writer.Length());
+            }
+        }
+        break;
 
-                else
-                    colorcode = "\017";
+        case bz_ePlayerSpawnEvent: {
+            // This event is called each time a playing tank is being spawned into the world
+            bz_PlayerSpawnEventData_V1* data = (bz_PlayerSpawnEventData_V1*)eventData;
 
-                if (callsign != "") {//send it only it is not a list server ping
-                    std::string subtotal = colorcode + callsign + "\017" + " left the game";
-                    std::string total = "PRIVMSG #" + ircChannel + " :" + ircPrefix + subtotal;
+            // Data
+            // ----
+            // (int)                  playerID  - ID of the player who was added to the world.
+            // (bz_eTeamType)         team      - The team the player is a member of.
+            // (bz_PlayerUpdateState) state     - The state record for the spawning player
+            // (double)               eventTime - Time local server time for the event.
 
-                    Send(total, 3);
-                    break;
-                }
+            // teams can change between spawns, e.g. when a rabbit gets chosen
+            if (data->playerID < 0 || data->playerID >= IRC_ROSTER_SIZE) break;
+            RosterEntry& player = roster[data->playerID];
+            if (player.active && player.team != data->team) {
+                player.Recolor(data->team);
+                rosterChanged = true;
             }
         }
         break;
 
+        case bz_ePlayerScoreChanged: {
+            // This event is called each time a player's score changes
+            bz_PlayerScoreChangeEventData_V1* data = (bz_PlayerScoreChangeEventData_V1*)eventData;
+
+            // Data
+            // ----
+            // (int)              playerID  - The player that has had a change of score
+            // (bz_eScoreElement) element   - The type of score that is being changed
+            // (int)              thisValue - The new amount of element score the playerID has
+            // (int)              lastValue - The old amount of element score the playerID had
+            // (double)           eventTime - The server time the event occurred
+
+            if (data->playerID < 0 || data->playerID >= IRC_ROSTER_SIZE) break;
+            RosterEntry& player = roster[data->playerID];
+            if (!player.active) break;
+
+            if (data->element == bz_eWins) player.wins = data->thisValue;
+            else if (data->element == bz_eLosses) player.losses = data->thisValue;
+            else if (data->element == bz_eTKs) player.teamKills = data->thisValue;
+            rosterChanged = true;
+        }
+        break;
+
+        case bz_eTeamScoreChanged: {
+            // This event is called each time a team's score changes
+
+            // the team scores are read when the next snapshot gets published
+            rosterChanged = true;
+        }
+        break;
+
+        case bz_ePlayerDieEvent: {
+            // This event is called each time a tank is killed
+            bz_PlayerDieEventData_V2* data = (bz_PlayerDieEventData_V2*)eventData;
+
+            // Data
+            // ----
+            // (int)                  playerID       - ID of the player who was killed.
+            // (bz_eTeamType)         team           - The team the killed player was on.
+            // (int)                  killerID       - The owner of the shot that killed the player, or BZ_SERVER for server side kills
+            // (bz_eTeamType)         killerTeam     - The team the owner of the shot was on.
+            // (bz_ApiString)         flagKilledWith - The flag name the owner of the shot had when the shot was fired.
+            // (int)                  flagHeldWhenKilled - The ID of the flag the victim was holding when they died.
+            // (int)                  shotID         - The shot ID that killed the player, if the player was not killed by a shot, the id will be -1.
+            // (double)               eventTime      - The time of the event.
+
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            if ((ircConfig->digest & (1 << DIGEST_KILL)) == 0 || (ircConfig->routed & (1 << RELAY_GAME)) == 0) break;
+
+            // suicides and server side kills only count towards the total
+            const RosterEntry* killer = data->killerID != data->playerID ? Player(data->killerID) : nullptr;
+            Collect(DIGEST_KILL, killer, data->team, 0);
+        }
+        break;
+
+        case bz_eCaptureEvent: {
+            // This event is called each time a team's flag has been captured
+            bz_CTFCaptureEventData_V1* data = (bz_CTFCaptureEventData_V1*)eventData;
+
+            // Data
+            // ----
+            // (bz_eTeamType) teamCapped    - The team whose flag was captured.
+            // (bz_eTeamType) teamCapping   - The team who did the capturing.
+            // (int)          playerCapping - The player who captured the flag.
+            // (float[3])     pos           - The world position(X,Y,Z) where the flag has been captured
+            // (float)        rot           - The rotational orientation of the capturing player
+            // (double)       eventTime     - This value is the local server time of the event.
+
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            if ((ircConfig->digest & (1 << DIGEST_CAPTURE)) == 0 || (ircConfig->routed & (1 << RELAY_GAME)) == 0) break;
+
+            Collect(DIGEST_CAPTURE, Player(data->playerCapping), data->teamCapped, 0);
+        }
+        break;
+
+        case bz_eGameStartEvent:
+        case bz_eGameEndEvent: {
+            // These events are called each time a game starts or ends
+            bz_GameStartEndEventData_V2* data = (bz_GameStartEndEventData_V2*)eventData;
+
+            // Data
+            // ----
+            // (double) duration  - The duration (in seconds) of the game.
+            // (int)    playerID  - The player who started or ended the game.
+            // (double) eventTime - The server time the event occurred.
+
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            if ((ircConfig->digest & (1 << DIGEST_START)) == 0 || (ircConfig->routed & (1 << RELAY_GAME)) == 0) break;
+
+            Collect(data->eventType == bz_eGameStartEvent ? DIGEST_START : DIGEST_END, nullptr, eNoTeam, data->duration);
+        }
+        break;
+
+        case bz_eTickEvent: {
+            // This event is called once for each BZFS main loop
+
+            // deliver the messages received from irc
+            std::shared_ptr<const IrcConfig> ircConfig = Config();
+            Dispatch(ircConfig->tickBudget);
+
+            // hand out the history that was asked for
+            if (history.Capacity() != ircConfig->history) history.Resize(ircConfig->history);
+            Scrollback(IRC_HISTORY_BUDGET);
+
+            // everything that changed during this tick goes out in one snapshot
+            if (rosterChanged) Publish();
+        }
+        break;
+
         default:
             break;
     }
 }
 
-void ircRelay::Receive(const char* until) {
-    std::string untilString = until == nullptr ? std::string() : std::string(until);
+bool ircRelay::SlashCommand(int playerID, bz_ApiString command, bz_ApiString message, bz_APIStringList* params) {
+    if (strcmp(command.c_str(), "ircstats") == 0) {
+        if (!bz_hasPerm(playerID, bz_perm_viewReports)) {
+            bz_sendTextMessage(BZ_SERVER, playerID, "You do not have permission to run the /ircstats command.");
+            return true;
+        }
 
-    bool found = false;
-    while (!found) {
-        char recv_buf[1025];
-        int r_len = read(fd, recv_buf, 1024);
-        if (r_len == -1) {
-            bz_debugMessage(1, "Connection lost to irc server");
-            Stop();
-        }
-
-        recv_buf[r_len] = '\0';
-        std::string data = recv_buf;
-        if (data.length() == 0) return;
-
-        // split received data into lines
-        size_t dataPos = 0;
-        std::string dataLine;
-        std::string dataDelimiter = "\r\n";
-        while ((dataPos = data.find(dataDelimiter)) != std::string::npos) {
-            dataLine = data.substr(0, dataPos);
-            data.erase(0, dataPos + dataDelimiter.length());
-            bz_debugMessage(4, dataLine.c_str());
-
-            // passing messages from the channel to BZFlag
-            if (dataLine.find("PRIVMSG", 0) != std::string::npos) {
-                // get username
-                std::string::size_type startpos = dataLine.find(":", 0);
-                std::string::size_type endpos = dataLine.find("!", 0);
-                std::string username = dataLine.substr(startpos + 1, endpos - 1);
-
-                // get message
-                startpos = dataLine.find(":", 1);
-                endpos = dataLine.size();
-                std::string message = dataLine.substr(startpos + 1, endpos);
-
-                // check if username is on the ignore list
-                bool ignored = false;
-                std::string ignoreDelimiter = ",";
-                std::string ircIgnores = bz_BZDBItemExists("_ircIgnore") ? bz_getBZDBString("_ircIgnore") : "";
-                if (ircIgnores.length() > 0) {
-                    size_t ignorePos = 0;
-                    std::string ircIgnore;
-                    while ((ignorePos = ircIgnores.find(ignoreDelimiter)) != std::string::npos || ircIgnores.length() > 0) {
-                        if (ignorePos == std::string::npos) ignorePos = ircIgnores.length();
-                        ircIgnore = ircIgnores.substr(0, ignorePos);
-                        ircIgnores.erase(0, ignorePos + ignoreDelimiter.length());
-
-                        if (username == ircIgnore) {
-                            ignored = true;
-                        }
-                    }
-                }
+        std::vector<std::string> lines;
+        Report(lines);
+        for (size_t i = 0; i < lines.size(); i++) bz_sendTextMessage(BZ_SERVER, playerID, lines[i].c_str());
+        return true;
+    }
 
-                // send the IRC message into the BZFlag chat
-                if (!ignored) {
-                    if (message.length() > 8 && message.substr(0, 7) == "\001ACTION") {
-                        std::string total = username + " " + message.substr(8, message.size());
-                        bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, eActionMessage, total.substr(0, total.size() - 1).c_str());
-                        bz_debugMessage(4, total.c_str());
-                    }
-                    else {
-                        std::string total = username + ": " + message;
-                        bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, total.c_str());
-                        bz_debugMessage(4, total.c_str());
-                    }
-                }
-                else {
-                    std::string debugMessage = "Message from " + username + " got ignored";
-                    bz_debugMessage(3, debugMessage.c_str());
-                }
-            }
+    if (strcmp(command.c_str(), "irchistory") == 0) {
+        if (history.Capacity() == 0) {
+            bz_sendTextMessage(BZ_SERVER, playerID, "The IRC history is turned off.");
+            return true;
+        }
 
-            // respond to pings
-            if (dataLine.substr(0, 4) == "PING") {
-                std::string pongdata = dataLine.substr(5, dataLine.size());
-                std::string pong = "PONG " + pongdata;
-                Send(pong, 4);
-                pingCount++;
-            }
+        // the newest lines are on the first page
+        int page = params->size() > 0 ? atoi(params->get(0).c_str()) : 1;
+        if (history.Pages() == 0) {
+            bz_sendTextMessage(BZ_SERVER, playerID, "Nothing has been relayed yet.");
+            return true;
+        }
+        if (page < 1 || (size_t)page > history.Pages()) {
+            std::string pages = "There are " + std::to_string(history.Pages()) + " pages of IRC history.";
+            bz_sendTextMessage(BZ_SERVER, playerID, pages.c_str());
+            return true;
+        }
+        Recall(playerID, page, IRC_HISTORY_PAGE);
+        return true;
+    }
 
-            if (untilString == "" || dataLine.substr(0, untilString.length()) == untilString) {
-                found = true;
-            }
+    if (strcmp(command.c_str(), "ircreplay") == 0) {
+        if (!bz_hasPerm(playerID, bz_perm_setAll)) {
+            bz_sendTextMessage(BZ_SERVER, playerID, "You do not have permission to run the /ircreplay command.");
+            return true;
+        }
+        if (params->size() < 1) {
+            bz_sendTextMessage(BZ_SERVER, playerID, "Usage: /ircreplay <capture file> [fast]");
+            return true;
+        }
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+        bz_sendTextMessage(BZ_SERVER, playerID, "Replaying captures is not supported on this platform.");
+#else
+        if (replaying.exchange(true)) {
+            bz_sendTextMessage(BZ_SERVER, playerID, "Another capture is being replayed right now.");
+            return true;
         }
 
-        if (until == nullptr) {
-            found = true;
+        // the replay runs on its own thread and only reports to the server log, a finished one is joined first
+        if (replayStarted) pthread_join(replayThread, NULL);
+        replayStarted = false;
+        IrcReplay* replay = new IrcReplay();
+        replay->path = params->get(0).c_str();
+        replay->fast = params->size() > 1 && strcmp(params->get(1).c_str(), "fast") == 0;
+        if (pthread_create(&replayThread, NULL, ReplayThread, replay) != 0) {
+            delete replay;
+            replaying = false;
+            bz_sendTextMessage(BZ_SERVER, playerID, "The replay could not be started.");
+            return true;
         }
+        replayStarted = true;
+        bz_sendTextMessage(BZ_SERVER, playerID, "Replaying the capture, the results go to the server log.");
+#endif
+        return true;
     }
+    return false;
 }
 
-void ircRelay::Send(std::string data, int debugLevel) {
-    bz_debugMessage(debugLevel, data.c_str());
+IrcHistogram::IrcHistogram() {
+    for (size_t i = 0; i < IRC_HISTOGRAM_SIZE; i++) buckets[i].store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
 
-    std::string line = data + "\r\n";
-    if (write(fd, line.c_str(), line.size()) == -1) {
-        bz_debugMessage(1, "Connection lost to irc server");
-        Stop();
+void IrcHistogram::Record(double seconds) {
+    uint64_t value = seconds > 0 ? (uint64_t)(seconds * 1000000) : 0;
+    buckets[Bucket(value)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+    IrcMetrics::Peak(max, value);
+}
+
+uint64_t IrcHistogram::Percentile(double percentile) const {
+    uint64_t total = Count();
+    if (total == 0) return 0;
+
+    // the upper limit of the bucket the percentile falls into, but never more than was seen
+    uint64_t rank = (uint64_t)(total * percentile / 100);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < IRC_HISTOGRAM_SIZE; i++) {
+        seen += buckets[i].load(std::memory_order_relaxed);
+        if (seen > rank) return Limit(i) < Max() ? Limit(i) : Max();
     }
+    return Max();
 }
 
-void ircRelay::Wait(unsigned int seconds, unsigned int milliseconds) {
-#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
-    Sleep((seconds * 1000) + milliseconds);
-#else
-    if (seconds > 0) sleep(seconds);
-    if (milliseconds > 0) usleep(milliseconds * 1000);
-#endif
+uint64_t IrcHistogram::UpTo(uint64_t value) const {
+    // like the le label of prometheus, a bucket counts when none of its values is above the given one
+    uint64_t seen = 0;
+    for (size_t i = 0; i < IRC_HISTOGRAM_SIZE && Limit(i) <= value; i++) seen += buckets[i].load(std::memory_order_relaxed);
+    return seen;
 }
 
-void ircRelay::Worker() {
-    bz_debugMessage(2, "Worker for irc server connection started");
-    Wait(0, 10);
+size_t IrcHistogram::Bucket(uint64_t value) {
+    if (value < 4) return (size_t)value;
 
-    while (!fc) {
-        // start if not already done
-        if (fd == 0) {
-            // wait longer with every attempt
-            unsigned int sleep = 5;
-            if (pingCount > 5) { pingCount = 0; retryCount = 0; }
-            for (int i = 0; i < retryCount; i++) { sleep = sleep * 2; }
-            Wait(sleep, 0);
-            retryCount++;
-
-            // start now
-            Start();
-            continue;
+    // the highest bit picks the power of two, the two bits below it one of its four buckets
+    size_t bit = 2;
+    while (bit < 63 && (value >> (bit + 1)) != 0) bit++;
+    return (bit - 1) * 4 + (size_t)((value >> (bit - 2)) & 3);
+}
+
+uint64_t IrcHistogram::Limit(size_t bucket) {
+    if (bucket < 4) return bucket;
+    size_t bit = bucket / 4 + 1;
+    uint64_t step = (uint64_t)1 << (bit - 2);
+    return (4 + bucket % 4 + 1) * step - 1;
+}
+
+IrcFilter::IrcFilter() {
+    Node node;
+    node.fail = 0;
+    node.pattern = -1;
+    node.output = 0;
+    nodes.push_back(node);
+    for (size_t i = 0; i < 256; i++) root[i] = 0;
+}
+
+void IrcFilter::Add(const std::string& pattern, FilterAction action, const std::string& replacement) {
+    // a leading or trailing * matches inside of words, everything else only whole words
+    size_t first = 0;
+    size_t last = pattern.size();
+    bool wordStart = !(last > first && pattern[first] == '*');
+    if (!wordStart) first++;
+    bool wordEnd = !(last > first && pattern[last - 1] == '*');
+    if (!wordEnd) last--;
+    if (last <= first) return;
+
+    int node = 0;
+    for (size_t i = first; i < last; i++) {
+        unsigned char c = (unsigned char)tolower((unsigned char)pattern[i]);
+        int next = Child(node, c);
+        if (next < 0) {
+            Node child;
+            child.fail = 0;
+            child.pattern = -1;
+            child.output = 0;
+            next = (int)nodes.size();
+            nodes.push_back(child);
+
+            // children stay sorted, so they can be found by a binary search
+            std::vector<std::pair<unsigned char, int> >& children = nodes[node].next;
+            children.insert(std::lower_bound(children.begin(), children.end(), std::make_pair(c, 0)), std::make_pair(c, next));
+        }
+        node = next;
+    }
+    if (nodes[node].pattern >= 0) return;
+
+    Pattern entry;
+    entry.length = last - first;
+    entry.wordStart = wordStart;
+    entry.wordEnd = wordEnd;
+    entry.action = action;
+    entry.replacement = replacement;
+    nodes[node].pattern = (int)patterns.size();
+    patterns.push_back(entry);
+}
+
+void IrcFilter::Compile() {
+    for (size_t i = 0; i < 256; i++) root[i] = 0;
+    for (size_t i = 0; i < nodes[0].next.size(); i++) root[nodes[0].next[i].first] = nodes[0].next[i].second;
+
+    // breadth first, so the fail link of every shorter suffix is known already
+    std::vector<int> queue;
+    for (size_t i = 0; i < nodes[0].next.size(); i++) queue.push_back(nodes[0].next[i].second);
+    for (size_t head = 0; head < queue.size(); head++) {
+        int node = queue[head];
+        for (size_t i = 0; i < nodes[node].next.size(); i++) {
+            unsigned char c = nodes[node].next[i].first;
+            int child = nodes[node].next[i].second;
+
+            int fail = nodes[node].fail;
+            int next;
+            while ((next = fail == 0 ? root[c] : Child(fail, c)) < 0) fail = nodes[fail].fail;
+            nodes[child].fail = next;
+            nodes[child].output = nodes[next].pattern >= 0 ? next : nodes[next].output;
+            queue.push_back(child);
         }
+    }
+}
+
+FilterAction IrcFilter::Apply(const char* text, size_t length, std::string& output) const {
+    struct Match {
+        size_t start;
+        size_t end;
+        int pattern;
+    };
+    std::vector<Match> matches;
+    FilterAction strongest = FILTER_PASS;
+
+    // a single pass over the text, every character follows at most a few fail links
+    int state = 0;
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)tolower((unsigned char)text[i]);
+        int next;
+        while ((next = state == 0 ? root[c] : Child(state, c)) < 0) state = nodes[state].fail;
+        state = next;
 
-        // receive messages
-        Receive(nullptr);
+        for (int node = nodes[state].pattern >= 0 ? state : nodes[state].output; node > 0; node = nodes[node].output) {
+            const Pattern& pattern = patterns[nodes[node].pattern];
+            size_t end = i + 1;
+            size_t start = end - pattern.length;
+            if (pattern.wordStart && start > 0 && isalnum((unsigned char)text[start - 1])) continue;
+            if (pattern.wordEnd && end < length && isalnum((unsigned char)text[end])) continue;
+            if (pattern.action == FILTER_DROP) return FILTER_DROP;
+
+            Match match = { start, end, nodes[node].pattern };
+            matches.push_back(match);
+        }
     }
+    if (matches.size() == 0) return FILTER_PASS;
 
-    bz_debugMessage(2, "Worker for irc server connection stopped");
+    // the first and longest match wins where matches overlap
+    std::sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) { return a.start != b.start ? a.start < b.start : a.end > b.end; });
+    size_t position = 0;
+    output.clear();
+    for (size_t i = 0; i < matches.size(); i++) {
+        const Match& match = matches[i];
+        if (match.start < position) continue;
+
+        const Pattern& pattern = patterns[match.pattern];
+        output.append(text + position, match.start - position);
+        if (pattern.action == FILTER_REWRITE) {
+            output += pattern.replacement;
+        }
+        else {
+            for (size_t j = match.start; j < match.end; j++) {
+                if (((unsigned char)text[j] & 0xC0) != 0x80) output += '*';
+            }
+        }
+        if (pattern.action > strongest) strongest = pattern.action;
+        position = match.end;
+    }
+    output.append(text + position, length - position);
+    return strongest;
+}
+
+int IrcFilter::Child(int node, unsigned char c) const {
+    const std::vector<std::pair<unsigned char, int> >& next = nodes[node].next;
+    std::vector<std::pair<unsigned char, int> >::const_iterator child = std::lower_bound(next.begin(), next.end(), std::make_pair(c, 0));
+    return child != next.end() && child->first == c ? child->second : -1;
+}
+
+// matches * and ? wildcards, going back to the last * on a mismatch
+static bool WildcardMatch(const char* pattern, const char* text) {
+    const char* star = nullptr;
+    const char* resume = nullptr;
+    while (*text != '\0') {
+        if (*pattern == '*') {
+            star = pattern++;
+            resume = text;
+        }
+        else if (*pattern == '?' || *pattern == *text) {
+            pattern++;
+            text++;
+        }
+        else if (star != nullptr) {
+            pattern = star + 1;
+            text = ++resume;
+        }
+        else {
+            return false;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+void IrcIgnore::Add(const std::string& entry) {
+    std::string lower = entry;
+    std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return (char)tolower(c); });
+
+    if (lower.find_first_of("*?") != std::string::npos) wildcards.push_back(lower);
+    else if (lower.find_first_of("!@") != std::string::npos) masks.insert(lower);
+    else nicks.insert(lower);
+}
+
+bool IrcIgnore::Matches(IrcSlice nick, IrcSlice user, IrcSlice host) const {
+    std::string mask;
+    for (size_t i = 0; i < nick.length; i++) mask += (char)tolower((unsigned char)nick.data[i]);
+    if (nicks.count(mask) > 0) return true;
+    if (masks.size() == 0 && wildcards.size() == 0) return false;
+
+    mask += '!';
+    for (size_t i = 0; i < user.length; i++) mask += (char)tolower((unsigned char)user.data[i]);
+    mask += '@';
+    for (size_t i = 0; i < host.length; i++) mask += (char)tolower((unsigned char)host.data[i]);
+    if (masks.count(mask) > 0) return true;
+
+    for (size_t i = 0; i < wildcards.size(); i++) {
+        if (WildcardMatch(wildcards[i].c_str(), mask.c_str())) return true;
+    }
+    return false;
+}
+
+void RosterEntry::Assign(const char* playerCallsign, int playerTeam, const char* playerIp) {
+    active = true;
+    snprintf(callsign, sizeof(callsign), "%s", playerCallsign);
+    snprintf(ip, sizeof(ip), "%s", playerIp);
+    Recolor(playerTeam);
+}
+
+void RosterEntry::Recolor(int playerTeam) {
+    // the coloured name is rendered once here instead of for every message
+    team = playerTeam;
+    const char* color = GetTeamStyle(team).color;
+    size_t colorLength = strnlen(color, sizeof(name) - 1);
+    size_t callsignLength = strnlen(callsign, sizeof(name) - 1 - colorLength);
+    memcpy(name, color, colorLength);
+    memcpy(name + colorLength, callsign, callsignLength);
+    nameLength = colorLength + callsignLength;
+    name[nameLength] = '\0';
+}
+
+void IrcHistory::Resize(size_t capacity) {
+    if (capacity == entries.size()) return;
+
+    // the newest lines survive, as many as still fit
+    std::vector<HistoryEntry> resized(capacity);
+    uint64_t first = next > capacity ? next - capacity : 0;
+    if (first < First()) first = First();
+    uint64_t count = 0;
+    for (uint64_t sequence = first; sequence < next; sequence++) resized[count++] = entries[sequence % entries.size()];
+    entries.swap(resized);
+    next = count;
+}
+
+void IrcHistory::Add(HistorySource source, const char* prefix, const char* text, size_t length) {
+    if (entries.size() == 0) return;
+
+    // the oldest entry gets overwritten in place
+    HistoryEntry& entry = entries[next % entries.size()];
+    LineWriter writer(entry.text, IRC_LINE_SIZE - 1);
+    writer.Append(prefix).Append(text, length);
+    entry.text[writer.Length()] = '\0';
+    entry.length = (uint16_t)writer.Length();
+    entry.source = (uint8_t)source;
+    entry.time = time(NULL);
+    next++;
+}
+
+bool IrcHistory::Page(size_t page, uint64_t& start, uint64_t& end) const {
+    if (page < 1 || page > Pages()) return false;
+    end = next - (page - 1) * IRC_HISTORY_PAGE;
+    start = end - First() > IRC_HISTORY_PAGE ? end - IRC_HISTORY_PAGE : First();
+    return true;
+}
+
+size_t IrcText::Scan(const char* text, size_t length) {
+    // the widest vector the compiler targets does the bulk, the next one and the scalar loop the rest
+    size_t i = 0;
+#if defined(__AVX2__)
+    i = ScanAvx2(text, length, i);
+#endif
+#if defined(IRCRELAY_SSE2)
+    i = ScanSse2(text, length, i);
+#endif
+    return ScanScalar(text, length, i);
+}
+
+size_t IrcText::ScanScalar(const char* text, size_t length, size_t start) {
+    for (size_t i = start; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c < 0x20 || c >= 0x7f) return i;
+    }
+    return length;
+}
+
+#if defined(IRCRELAY_SSE2)
+size_t IrcText::ScanSse2(const char* text, size_t length, size_t start) {
+    // bytes from 0x80 up count as negative, so one signed compare finds control bytes and utf-8 alike
+    const __m128i space128 = _mm_set1_epi8(0x20);
+    const __m128i delete128 = _mm_set1_epi8(0x7f);
+    size_t i = start;
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(text + i));
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(chunk, space128), _mm_cmpeq_epi8(chunk, delete128))) != 0) break;
+    }
+    return i;
+}
+#endif
+
+#if defined(IRCRELAY_AVX2)
+IRCRELAY_AVX2 size_t IrcText::ScanAvx2(const char* text, size_t length, size_t start) {
+    const __m256i space256 = _mm256_set1_epi8(0x20);
+    const __m256i delete256 = _mm256_set1_epi8(0x7f);
+    size_t i = start;
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(text + i));
+        if (_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(space256, chunk), _mm256_cmpeq_epi8(chunk, delete256))) != 0) break;
+    }
+    return i;
+}
+#endif
+
+size_t IrcText::Utf8Length(const unsigned char* text, size_t length) {
+    // the length of a valid sequence, or zero for overlong forms, surrogates and anything past U+10FFFF
+    unsigned char c = text[0];
+    size_t size = c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 : c >= 0xF0 && c <= 0xF4 ? 4 : 0;
+    if (size == 0 || size > length) return 0;
+    for (size_t i = 1; i < size; i++) {
+        if ((text[i] & 0xC0) != 0x80) return 0;
+    }
+    if (c == 0xE0 && text[1] < 0xA0) return 0;
+    if (c == 0xED && text[1] > 0x9F) return 0;
+    if (c == 0xF0 && text[1] < 0x90) return 0;
+    if (c == 0xF4 && text[1] > 0x8F) return 0;
+    return size;
+}
+
+bool IrcText::FromIrc(const char* text, size_t length, std::string& translated) {
+    // the mIRC colours as close as the bzflag ansi colours get
+    static const char* colors[] = {
+        "\033[37m", "\033[30m", "\033[34m", "\033[32m", "\033[31m", "\033[31m", "\033[35m", "\033[130m",
+        "\033[33m", "\033[32m", "\033[36m", "\033[36m", "\033[34m", "\033[35m", "\033[30m", "\033[37m"
+    };
+    static const char* reset = "\033[0;1m";
+
+    size_t start = Scan(text, length);
+    if (start == length) return false;
+
+    const unsigned char* bytes = (const unsigned char*)text;
+    translated.reserve(length + 16);
+    translated.assign(text, start);
+
+    // mIRC toggles underline and reverse, but ansi can only reset everything and apply the rest again
+    const char* color = nullptr;
+    bool underline = false;
+    bool reverse = false;
+    auto restore = [&]() {
+        translated += reset;
+        if (color != nullptr) translated += color;
+        if (underline) translated += "\033[4m";
+        if (reverse) translated += "\033[7m";
+    };
+
+    for (size_t i = start; i < length;) {
+        unsigned char c = bytes[i];
+        if (c >= 0x20 && c < 0x7f) {
+            translated += (char)c;
+            i++;
+            continue;
+        }
+        if (c >= 0x80) {
+            size_t size = Utf8Length(bytes + i, length - i);
+            if (size == 0) translated += '?';
+            else translated.append(text + i, size);
+            i += size == 0 ? 1 : size;
+            continue;
+        }
+
+        i++;
+        if (c == 0x03) {
+            // a colour has one or two digits and maybe a background, without any it ends the colour
+            int code = -1;
+            if (i < length && isdigit(bytes[i])) {
+                code = bytes[i++] - '0';
+                if (i < length && isdigit(bytes[i])) code = code * 10 + bytes[i++] - '0';
+            }
+            if (code >= 0 && i + 1 < length && bytes[i] == ',' && isdigit(bytes[i + 1])) {
+                i += 2;
+                if (i < length && isdigit(bytes[i])) i++;
+            }
+            if (code < 0 && color != nullptr) {
+                color = nullptr;
+                restore();
+            }
+            else if (code >= 0 && code < 16) {
+                color = colors[code];
+                translated += color;
+            }
+        }
+        else if (c == 0x04) {
+            // hex colours have no bzflag counterpart, so only their digits go
+            for (size_t digits = 0; digits < 6 && i < length && isxdigit(bytes[i]); digits++) i++;
+        }
+        else if (c == 0x0F) {
+            if (color != nullptr || underline || reverse) translated += reset;
+            color = nullptr;
+            underline = false;
+            reverse = false;
+        }
+        else if (c == 0x1F || c == 0x16) {
+            bool& flag = c == 0x1F ? underline : reverse;
+            flag = !flag;
+            if (flag) translated += c == 0x1F ? "\033[4m" : "\033[7m";
+            else restore();
+        }
+        else if (c == '\t' || c == '\r' || c == '\n') {
+            translated += ' ';
+        }
+        // bold, italics, ctcp delimiters and all other control bytes are dropped
+    }
+
+    // combined messages must not inherit the formatting
+    if (color != nullptr || underline || reverse) translated += reset;
+    return true;
+}
+
+bool IrcText::FromGame(const char* text, size_t length, std::string& translated) {
+    size_t start = Scan(text, length);
+    if (start == length) return false;
+
+    const unsigned char* bytes = (const unsigned char*)text;
+    translated.reserve(length);
+    translated.assign(text, start);
+    for (size_t i = start; i < length;) {
+        unsigned char c = bytes[i];
+        if (c >= 0x20 && c < 0x7f) {
+            translated += (char)c;
+            i++;
+            continue;
+        }
+        if (c >= 0x80) {
+            size_t size = Utf8Length(bytes + i, length - i);
+            if (size == 0) translated += '?';
+            else translated.append(text + i, size);
+            i += size == 0 ? 1 : size;
+            continue;
+        }
+
+        i++;
+        if (c == 0x1B && i < length && bytes[i] == '[') {
+            // ansi sequences end with their first letter
+            for (i++; i < length && !(bytes[i] >= 0x40 && bytes[i] <= 0x7E); i++) {}
+            if (i < length) i++;
+        }
+        else if (c == '\t' || c == '\r' || c == '\n') {
+            translated += ' ';
+        }
+        // all other control bytes could inject irc formatting, so they are dropped
+    }
+    return true;
+}
+
+IrcReader::IrcReader() {
+    Reset();
+}
+
+char* IrcReader::Space(size_t& available) {
+    // move the incomplete line to the front, so there is room for the next read
+    if (start > 0) {
+        memmove(buffer, buffer + start, end - start);
+        end = end - start;
+        start = 0;
+    }
+
+    // a line that fills the whole buffer can never complete, so it gets discarded
+    if (end == IRC_BUFFER_SIZE - 1) {
+        bz_debugMessage(2, "Received line from irc server is too long and got discarded");
+        end = 0;
+        overflow = true;
+    }
+
+    available = IRC_BUFFER_SIZE - 1 - end;
+    return buffer + end;
+}
+
+void IrcReader::Fill(size_t length) {
+    end = end + length;
+}
+
+bool IrcReader::Next(IrcMessage& message) {
+    while (true) {
+        char* first = buffer + start;
+        char* last = (char*)memchr(first, '\n', end - start);
+        if (last == nullptr) return false;
+        start = (last - buffer) + 1;
+
+        // skip the rest of a discarded line
+        if (overflow) {
+            overflow = false;
+            continue;
+        }
+
+        // terminate the line in place, so it can be logged without a copy
+        if (last > first && *(last - 1) == '\r') last--;
+        *last = '\0';
+        if (last == first) continue;
+
+        memset(&message, 0, sizeof(message));
+        message.line.data = first;
+        message.line.length = last - first;
+
+        char* pos = first;
+        char* next;
+
+        // message tags
+        if (*pos == '@') {
+            next = (char*)memchr(pos, ' ', last - pos);
+            if (next == nullptr) next = last;
+            message.tags.data = pos + 1;
+            message.tags.length = next - pos - 1;
+            pos = next;
+            while (pos < last && *pos == ' ') pos++;
+        }
+
+        // prefix with nick, user and host
+        if (pos < last && *pos == ':') {
+            next = (char*)memchr(pos, ' ', last - pos);
+            if (next == nullptr) next = last;
+            message.prefix.data = pos + 1;
+            message.prefix.length = next - pos - 1;
+
+            const char* nickEnd = message.prefix.data + message.prefix.length;
+            const char* hostStart = (const char*)memchr(message.prefix.data, '@', message.prefix.length);
+            if (hostStart != nullptr) {
+                message.host.data = hostStart + 1;
+                message.host.length = nickEnd - hostStart - 1;
+                nickEnd = hostStart;
+            }
+            const char* userStart = (const char*)memchr(message.prefix.data, '!', nickEnd - message.prefix.data);
+            if (userStart != nullptr) {
+                message.user.data = userStart + 1;
+                message.user.length = nickEnd - userStart - 1;
+                nickEnd = userStart;
+            }
+            message.nick.data = message.prefix.data;
+            message.nick.length = nickEnd - message.prefix.data;
+
+            pos = next;
+            while (pos < last && *pos == ' ') pos++;
+        }
+
+        // command
+        next = (char*)memchr(pos, ' ', last - pos);
+        if (next == nullptr) next = last;
+        message.command.data = pos;
+        message.command.length = next - pos;
+        pos = next;
+
+        // parameters, the trailing one may contain spaces
+        while (pos < last && message.paramCount < IRC_PARAMS_SIZE) {
+            while (pos < last && *pos == ' ') pos++;
+            if (pos == last) break;
+
+            IrcSlice& param = message.params[message.paramCount++];
+            if (*pos == ':' || message.paramCount == IRC_PARAMS_SIZE) {
+                if (*pos == ':') pos++;
+                param.data = pos;
+                param.length = last - pos;
+                message.trailing = true;
+                break;
+            }
+
+            next = (char*)memchr(pos, ' ', last - pos);
+            if (next == nullptr) next = last;
+            param.data = pos;
+            param.length = next - pos;
+            pos = next;
+        }
+
+        if (message.command.length == 0) continue;
+        return true;
+    }
+}
+
+void IrcReader::Reset() {
+    start = 0;
+    end = 0;
+    overflow = false;
+}
+
+IrcSpool::IrcSpool() {
+    capacity = 0;
+    fd = -1;
+    mapped = 0;
+    header = nullptr;
+    records = nullptr;
+}
+
+IrcSpool::~IrcSpool() {
+    Close();
+}
+
+bool IrcSpool::Open(const std::string& path, size_t capacity) {
+    Close();
+    this->path = path;
+    this->capacity = capacity;
+    if (path == "") return false;
+
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    bz_debugMessage(1, "Spooling irc lines skipped, because it is not supported on this platform");
+    return false;
+#else
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        std::string debugMessage = "Spooling irc lines skipped, because " + path + " could not be opened";
+        bz_debugMessage(1, debugMessage.c_str());
+        return false;
+    }
+
+    // a file of another size gets started over
+    size_t size = sizeof(SpoolHeader) + capacity * sizeof(SpoolRecord);
+    struct stat info;
+    bool fresh = fstat(fd, &info) != 0 || (size_t)info.st_size != size;
+    if (fresh && ftruncate(fd, size) != 0) {
+        std::string debugMessage = "Spooling irc lines skipped, because " + path + " could not be resized";
+        bz_debugMessage(1, debugMessage.c_str());
+        Close();
+        return false;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        std::string debugMessage = "Spooling irc lines skipped, because " + path + " could not be mapped";
+        bz_debugMessage(1, debugMessage.c_str());
+        Close();
+        return false;
+    }
+    mapped = size;
+    header = (SpoolHeader*)map;
+    records = (SpoolRecord*)((char*)map + sizeof(SpoolHeader));
+
+    // lines spooled before a restart are kept, as long as the layout still fits
+    if (fresh || header->magic != IRC_SPOOL_MAGIC || header->recordSize != sizeof(SpoolRecord) || header->capacity != capacity || header->tail - header->head > capacity) {
+        memset(header, 0, sizeof(SpoolHeader));
+        header->magic = IRC_SPOOL_MAGIC;
+        header->recordSize = sizeof(SpoolRecord);
+        header->capacity = capacity;
+    }
+
+    std::string debugMessage = "Spooling irc lines to " + path + ", " + std::to_string(Size()) + " lines are waiting";
+    bz_debugMessage(2, debugMessage.c_str());
+    return true;
+#endif
+}
+
+void IrcSpool::Close() {
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+    if (header != nullptr) munmap(header, mapped);
+    if (fd >= 0) close(fd);
+#endif
+    fd = -1;
+    mapped = 0;
+    header = nullptr;
+    records = nullptr;
+}
+
+void IrcSpool::Append(const RelayLine& line, const char* channel) {
+    if (header == nullptr) return;
+
+    // a full spool gives up its oldest line
+    if (header->tail - header->head >= capacity) {
+        header->head++;
+        metrics.outboundDropped++;
+    }
+
+    SpoolRecord& record = records[header->tail % capacity];
+    record.created = (int64_t)time(NULL) - (int64_t)(ircRelay::Now() - line.created);
+    record.kind = line.kind;
+    record.length = line.length < IRC_TEXT_SIZE ? line.length : IRC_TEXT_SIZE;
+    memcpy(record.name, line.name, BZ_CALLSIGN_SIZE);
+    strncpy(record.channel, channel, IRC_CHANNEL_SIZE - 1);
+    record.channel[IRC_CHANNEL_SIZE - 1] = '\0';
+    memcpy(record.text, line.text, record.length);
+
+    // the record is complete before the tail moves past it
+    header->tail++;
+}
+
+bool IrcSpool::Pop(OutboundLine& line, int maxAge) {
+    if (header == nullptr) return false;
+
+    int64_t now = (int64_t)time(NULL);
+    while (header->head < header->tail) {
+        const SpoolRecord& record = records[header->head % capacity];
+
+        // skip what got collapsed or is too old to be of interest
+        bool skip = record.kind == IRC_SPOOL_SKIPPED;
+        if (!skip && now - record.created > maxAge) {
+            metrics.outboundDropped++;
+            skip = true;
+        }
+        if (!skip && record.kind == OUTBOUND_JOIN && Collapse(record)) skip = true;
+        if (skip) {
+            header->head++;
+            continue;
+        }
+
+        LineWriter writer(line.text, IRC_TEXT_SIZE);
+        if (record.channel[0] != '\0') writer.Append("PRIVMSG #").Append(record.channel).Append(" :");
+        writer.Append(record.text, record.length);
+        line.created = ircRelay::Now() - (now - record.created);
+        line.kind = (OutboundKind)record.kind;
+        line.length = writer.Length();
+        memcpy(line.name, record.name, BZ_CALLSIGN_SIZE);
+        header->head++;
+        return true;
+    }
+    return false;
+}
+
+bool IrcSpool::Collapse(const SpoolRecord& join) {
+    // a player who joined and left again while we were away is not worth mentioning
+    for (uint64_t i = header->head + 1; i < header->tail; i++) {
+        SpoolRecord& record = records[i % capacity];
+        if (record.kind != OUTBOUND_PART || strcmp(record.name, join.name) != 0 || strcmp(record.channel, join.channel) != 0) continue;
+        record.kind = IRC_SPOOL_SKIPPED;
+        return true;
+    }
+    return false;
+}
+
+int PlainTransport::Read(char* buffer, size_t length) {
+    int r_len = recv(fd, buffer, length, 0);
+    if (r_len < 0 && ircRelay::Pending()) return 0;
+    return r_len > 0 ? r_len : -1;
+}
+
+int PlainTransport::Write(const char* buffer, size_t length) {
+    int w_len = send(fd, buffer, length, MSG_NOSIGNAL);
+    if (w_len < 0 && ircRelay::Pending()) return 0;
+    return w_len > 0 ? w_len : -1;
+}
+
+#if defined(IRCRELAY_TLS)
+TlsTransport::TlsTransport(int fd, const std::string& host, bool verify, SSL_SESSION** session) {
+    this->session = session;
+    wantsWrite = false;
+
+    // one context for all connections, it hands new sessions to whoever owns the connection
+    if (tlsContext == nullptr) {
+        tlsContext = SSL_CTX_new(TLS_client_method());
+        if (tlsContext != nullptr) {
+            SSL_CTX_set_min_proto_version(tlsContext, TLS1_2_VERSION);
+            SSL_CTX_set_default_verify_paths(tlsContext);
+            SSL_CTX_set_session_cache_mode(tlsContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(tlsContext, TlsTransport::NewSession);
+        }
+    }
+
+    ssl = tlsContext != nullptr ? SSL_new(tlsContext) : nullptr;
+    if (ssl == nullptr) return;
+    SSL_set_fd(ssl, fd);
+    SSL_set_app_data(ssl, this);
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+    // an address is checked against the addresses in the certificate, and is never sent as server name
+    unsigned char literal[sizeof(struct in6_addr)];
+    bool address = inet_pton(AF_INET, host.c_str(), literal) == 1 || inet_pton(AF_INET6, host.c_str(), literal) == 1;
+    if (!address) SSL_set_tlsext_host_name(ssl, host.c_str());
+    if (verify) {
+        SSL_set_verify(ssl, SSL_VERIFY_PEER, NULL);
+        if (address) X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str());
+        else SSL_set1_host(ssl, host.c_str());
+    }
+    else {
+        SSL_set_verify(ssl, SSL_VERIFY_NONE, NULL);
+    }
+
+    // a session of the previous connection skips the full handshake
+    if (*session != nullptr) SSL_set_session(ssl, *session);
+    SSL_set_connect_state(ssl);
+}
+
+TlsTransport::~TlsTransport() {
+    Close();
+}
+
+int TlsTransport::Handshake() {
+    if (ssl == nullptr) return -1;
+
+    int result = SSL_do_handshake(ssl);
+    if (result == 1) {
+        wantsWrite = false;
+        return 1;
+    }
+    if (Retry(result)) return 0;
+
+    long verifyResult = SSL_get_verify_result(ssl);
+    std::string debugMessage = "TLS handshake failed: ";
+    debugMessage += verifyResult != X509_V_OK ? X509_verify_cert_error_string(verifyResult) : ERR_error_string(ERR_get_error(), NULL);
+    bz_debugMessage(1, debugMessage.c_str());
+    ERR_clear_error();
+    return -1;
+}
+
+int TlsTransport::Read(char* buffer, size_t length) {
+    int result = SSL_read(ssl, buffer, (int)length);
+    if (result > 0) return result;
+    if (Retry(result)) return 0;
+    ERR_clear_error();
+    return -1;
+}
+
+int TlsTransport::Write(const char* buffer, size_t length) {
+    int result = SSL_write(ssl, buffer, (int)length);
+    if (result > 0) {
+        wantsWrite = false;
+        return result;
+    }
+    if (Retry(result)) return 0;
+    ERR_clear_error();
+    return -1;
+}
+
+void TlsTransport::Close() {
+    if (ssl == nullptr) return;
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ssl = nullptr;
+}
+
+int TlsTransport::NewSession(SSL* ssl, SSL_SESSION* session) {
+    TlsTransport* transport = (TlsTransport*)SSL_get_app_data(ssl);
+    if (transport == nullptr) return 0;
+
+    // keep a copy of the newest session, openssl marks the original as not resumable when the server hangs up without a close notify
+    SSL_SESSION* copy = SSL_SESSION_dup(session);
+    if (copy == nullptr) return 0;
+    if (*transport->session != nullptr) SSL_SESSION_free(*transport->session);
+    *transport->session = copy;
+    return 0;
+}
+
+bool TlsTransport::Retry(int result) {
+    int error = SSL_get_error(ssl, result);
+    wantsWrite = error == SSL_ERROR_WANT_WRITE;
+    return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE;
+}
+#endif
+
+IrcConnection::IrcConnection(size_t index) : outbound(IRC_QUEUE_SIZE) {
+    this->index = index;
+    fd = 0;
+    state = IRC_DISCONNECTED;
+    reconfigure = false;
+    spooling = false;
+    deadline = 0;
+    nextAttempt = ircRelay::Now();
+    pingCount = 0;
+    retryCount = 0;
+    jitter.seed((unsigned int)(std::chrono::steady_clock::now().time_since_epoch().count() + index));
+    connectCount = 0;
+    negotiating = false;
+    saslOffered = false;
+    pingTime = 0;
+    pingSent = 0;
+    endpointCount = 0;
+    endpointNext = 0;
+    endpointPort = 0;
+    endpointExpires = 0;
+    resolveGeneration = 0;
+    attemptCount = 0;
+    attemptTime = 0;
+    handshakeTime = 0;
+#if defined(IRCRELAY_TLS)
+    tlsSession = nullptr;
+#endif
+    writeLength = 0;
+    coalesced = 0;
+    tokens = 0;
+    tokensTime = 0;
+    holding = false;
+}
+
+bool IrcConnection::Enqueue(RelayLine* line, const std::string& channel, OverflowPolicy policy) {
+    // make room or give up, depending on the overflow policy
+    RingQueue<OutboundEntry>::Cell* cell = outbound.Claim();
+    if (cell == nullptr && policy == OVERFLOW_OLDEST) {
+        RingQueue<OutboundEntry>::Cell* oldest = outbound.Acquire();
+        if (oldest != nullptr) {
+            ircRelay::Release(oldest->data.line);
+            outbound.Release(oldest);
+            metrics.outboundDropped++;
+        }
+        cell = outbound.Claim();
+    }
+    if (cell == nullptr) {
+        if (policy == OVERFLOW_COALESCE && channel != "") Coalesce(channel);
+        metrics.outboundDropped++;
+        return false;
+    }
+
+    cell->data.line = line;
+    size_t length = channel.size() < IRC_CHANNEL_SIZE ? channel.size() : IRC_CHANNEL_SIZE - 1;
+    memcpy(cell->data.channel, channel.c_str(), length);
+    cell->data.channel[length] = '\0';
+    outbound.Commit(cell);
+    metrics.outboundQueued++;
+    IrcMetrics::Peak(metrics.outboundPeak, outbound.Size());
+    return true;
+}
+
+void IrcConnection::Reconfigure() {
+    reconfigure = true;
+    ircRelay::Wake();
+}
+
+void IrcConnection::Update(double now) {
+    // a changed config gets applied to the running connection
+    if (reconfigure.exchange(false)) Apply(now);
+
+    // while another server is the hub, its connections are used instead
+    if (hubRole == HUB_CLIENT) {
+        if (fd != 0 && state != IRC_HANDSHAKING) {
+            Send("QUIT :Sharing the connection of another server", 3);
+            Write();
+        }
+        if (state != IRC_DISCONNECTED) Stop();
+        nextAttempt = now;
+        retryCount = 0;
+        return;
+    }
+
+    if (state == IRC_DISCONNECTED && now >= nextAttempt) {
+        if (index >= ircRelay::Config()->networks.size()) return;
+
+        // wait longer with every attempt, and spread the attempts so relays do not all come back at once
+        double sleep = 5;
+        if (pingCount > 5) { pingCount = 0; retryCount = 0; }
+        for (unsigned int i = 0; i < retryCount && sleep < 300; i++) { sleep = sleep * 2; }
+        std::uniform_real_distribution<double> spread(0.75, 1.25);
+        nextAttempt = now + sleep * spread(jitter);
+        retryCount++;
+
+        // start now
+        Start();
+    }
+    else if (state == IRC_IDENTIFYING && now >= deadline) {
+        Join();
+    }
+    else if (state == IRC_CONNECTING && now >= attemptTime && now < deadline && endpointNext < endpointCount) {
+        // the pending attempts take too long, so the next address gets tried alongside them
+        Attempt(now);
+    }
+    else if (state != IRC_DISCONNECTED && state != IRC_CONNECTED && now >= deadline) {
+        bz_debugMessage(1, "Connection to irc server timed out");
+        Stop();
+    }
+
+    // measure the round trip to the server now and then
+    if (state == IRC_CONNECTED && now >= pingTime) {
+        Send("PING :ircrelay", 4);
+        pingSent = now;
+        pingTime = now + IRC_PING_INTERVAL;
+    }
+
+    // keep the spool in line with the config, lines that can not be sent now wait in there
+    std::shared_ptr<const IrcConfig> ircConfig = ircRelay::Config();
+    std::string spoolPath = ircConfig->spool != "" && index < ircConfig->networks.size() ? ircConfig->spool + "." + ircConfig->networks[index].name : "";
+    if (!spool.Matches(spoolPath, ircConfig->spoolSize)) {
+        spooling = spool.Open(spoolPath, ircConfig->spoolSize);
+    }
+    if (spooling && state != IRC_CONNECTED) Spill(false);
+
+    // send queued messages
+    if (state == IRC_CONNECTED) Drain();
+}
+
+double IrcConnection::Due(double now) {
+    if (hubRole == HUB_CLIENT) return now + 60;
+    if (state == IRC_DISCONNECTED) return index < ircRelay::Config()->networks.size() ? nextAttempt : now + 60;
+    if (state == IRC_CONNECTING && endpointNext < endpointCount && attemptTime < deadline) return attemptTime;
+    if (state != IRC_CONNECTED) return deadline;
+    if (tokens < 1 && (holding || outbound.Size() > 0 || spool.Size() > 0)) return now + (1 - tokens) / ircRelay::Config()->rate;
+    return pingTime < now + 1 ? pingTime : now + 1;
+}
+
+size_t IrcConnection::Poll(struct pollfd* pfds) {
+    // while connecting every pending attempt is watched, afterwards only the connection itself
+    if (state == IRC_CONNECTING) {
+        for (size_t i = 0; i < attemptCount; i++) {
+            pfds[i].fd = attempts[i];
+            pfds[i].events = POLLOUT;
+            pfds[i].revents = 0;
+        }
+        return attemptCount;
+    }
+    if (fd == 0) return 0;
+
+    pfds[0].fd = fd;
+    pfds[0].events = POLLIN;
+    if ((writeLength > 0 && state != IRC_HANDSHAKING) || (transport && transport->WantsWrite())) pfds[0].events |= POLLOUT;
+    pfds[0].revents = 0;
+    return 1;
+}
+
+void IrcConnection::Process(struct pollfd* pfds, size_t count) {
+    short revents = 0;
+    if (state == IRC_CONNECTING) revents = Complete(pfds, count);
+    else if (count > 0 && pfds[0].fd == fd) revents = pfds[0].revents;
+    if (fd == 0 || revents == 0) return;
+
+    // nothing but the handshake happens until it is done
+    if (state == IRC_HANDSHAKING && (!Secure() || state == IRC_HANDSHAKING)) return;
+
+    // receive and send whatever is possible without blocking
+    bool alive = true;
+    if (revents & (POLLIN | POLLHUP | POLLERR)) alive = Receive();
+    if (alive && fd != 0) alive = Write();
+    if (!alive) {
+        Stop();
+    }
+}
+
+void IrcConnection::Resolved(const IrcResolve& resolve) {
+    // answers to an abandoned lookup are of no use anymore
+    if (resolve.generation != resolveGeneration || state != IRC_RESOLVING) return;
+
+    if (resolve.count == 0) {
+        std::string debugMessage = "Could not resolve irc server " + std::string(resolve.host);
+        bz_debugMessage(1, debugMessage.c_str());
+        Stop();
+        return;
+    }
+
+    double now = ircRelay::Now();
+    memcpy(endpoints, resolve.endpoints, sizeof(endpoints));
+    endpointCount = resolve.count;
+    endpointHost = resolve.host;
+    endpointPort = resolve.port;
+    endpointExpires = now + IRC_RESOLVE_TTL;
+    Connect(now);
+}
+
+void IrcConnection::Shutdown() {
+    // close the connection on shutdown
+    if (fd != 0 && state != IRC_HANDSHAKING) {
+        Send("QUIT :Server shutting down", 3);
+        Write();
+    }
+    if (state != IRC_DISCONNECTED) Stop();
+#if defined(IRCRELAY_TLS)
+    if (tlsSession != nullptr) SSL_SESSION_free(tlsSession);
+    tlsSession = nullptr;
+#endif
+
+    // whatever is still queued waits in the spool for the next start
+    if (spooling) Spill(false);
+    spooling = false;
+    spool.Close();
+}
+
+void IrcConnection::Start() {
+    bz_debugMessage(2, "Starting ircRelay custom plugin");
+
+    // get config
+    active = ircRelay::Config();
+    if (index >= active->networks.size()) return;
+    const IrcNetwork& network = active->networks[index];
+    if (network.address == "") { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because address is still empty"); return; }
+    if (network.address.size() >= IRC_HOST_SIZE) { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because address is too long"); return; }
+    if (network.channels.size() == 0) { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because channel is still empty"); return; }
+    if (active->nick == "") { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because nick is still empty"); return; }
+#if !defined(IRCRELAY_TLS)
+    if (network.tls) { bz_debugMessage(1, "Starting ircRelay custom plugin skipped, because it was built without tls"); return; }
+#endif
+    if (state != IRC_DISCONNECTED) { bz_debugMessage(2, "Starting ircRelay custom plugin skipped, because its already running"); return; }
+
+    // addresses resolved before are used again until their time to live is over
+    double now = ircRelay::Now();
+    if (endpointCount > 0 && endpointHost == network.address && endpointPort == network.port && now < endpointExpires) {
+        Connect(now);
+        return;
+    }
+
+    IrcResolve request;
+    request.index = index;
+    request.generation = ++resolveGeneration;
+    memcpy(request.host, network.address.c_str(), network.address.size() + 1);
+    request.port = network.port;
+    state = IRC_RESOLVING;
+    deadline = now + IRC_RESOLVE_TIMEOUT;
+
+    // numeric addresses never block, so only host names are handed to the resolver thread
+    if (ircRelay::Lookup(request)) {
+        Resolved(request);
+        return;
+    }
+    if (!ircRelay::Resolve(request)) {
+        bz_debugMessage(1, "Resolving irc server skipped, because too many lookups are pending");
+        Stop();
+    }
+}
+
+void IrcConnection::Apply(double now) {
+    std::shared_ptr<const IrcConfig> ircConfig = ircRelay::Config();
+    bool before = active && index < active->networks.size();
+    bool after = index < ircConfig->networks.size();
+    if (!before && !after) return;
+
+    // only another server or login needs a new connection, everything else is applied as it is
+    bool reconnect = before != after;
+    bool changed = reconnect;
+    if (before && after) {
+        const IrcNetwork& previous = active->networks[index];
+        const IrcNetwork& current = ircConfig->networks[index];
+        reconnect = current.address != previous.address || current.port != previous.port || current.tls != previous.tls || ircConfig->tlsVerify != active->tlsVerify ||
+            current.pass != previous.pass || current.authType != previous.authType || current.authPass != previous.authPass;
+        changed = reconnect || current.channels != previous.channels || ircConfig->nick != active->nick;
+
+        // channels are left and joined on the live connection
+        if (!reconnect && state == IRC_CONNECTED && current.channels != previous.channels) {
+            std::string joined;
+            for (size_t i = 0; i < previous.channels.size(); i++) {
+                if (std::find(current.channels.begin(), current.channels.end(), previous.channels[i]) == current.channels.end()) Send("PART #" + previous.channels[i], 3);
+            }
+            for (size_t i = 0; i < current.channels.size(); i++) {
+                if (std::find(previous.channels.begin(), previous.channels.end(), current.channels[i]) != previous.channels.end()) continue;
+                if (joined != "") joined += ",";
+                joined += "#" + current.channels[i];
+            }
+            if (joined != "") Send("JOIN " + joined, 3);
+        }
+    }
+    active = ircConfig;
+
+    if (reconnect && state != IRC_DISCONNECTED) {
+        bz_debugMessage(2, "Reconnecting to irc server, because its address or login changed");
+        if (fd != 0 && state != IRC_HANDSHAKING) {
+            Send("QUIT :Reconfiguring", 3);
+            Write();
+        }
+        Stop();
+    }
+
+    // a connection that is down or got stopped for the change starts over right away
+    if (changed && state == IRC_DISCONNECTED) {
+        nextAttempt = now;
+        retryCount = 0;
+    }
+}
+
+void IrcConnection::Connect(double now) {
+    std::string debugMessage = "Connecting to irc server " + endpointHost;
+    bz_debugMessage(1, debugMessage.c_str());
+
+    if (connectCount++ > 0) metrics.reconnects++;
+
+    // the worker continues as soon as one of the attempts becomes writable
+    state = IRC_CONNECTING;
+    deadline = now + IRC_CONNECT_TIMEOUT;
+    endpointNext = 0;
+    if (!Attempt(now)) {
+        debugMessage = "Connection to irc server " + endpointHost + " failed";
+        bz_debugMessage(1, debugMessage.c_str());
+        endpointExpires = 0;
+        Stop();
+    }
+}
+
+bool IrcConnection::Attempt(double now) {
+    // start connecting to the next address, without giving up on the ones still pending
+    while (endpointNext < endpointCount) {
+        const IrcEndpoint& endpoint = endpoints[endpointNext++];
+
+        char host[64];
+        if (getnameinfo((const struct sockaddr*)endpoint.address, endpoint.length, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0) strcpy(host, "?");
+        std::string debugMessage = "Connecting to irc server " + endpointHost + " at " + host;
+        bz_debugMessage(2, debugMessage.c_str());
+
+        int attempt = socket(endpoint.family, SOCK_STREAM, 0);
+        if (attempt < 0) continue;
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+        u_long nonBlocking = 1;
+        ioctlsocket(attempt, FIONBIO, &nonBlocking);
+#else
+        fcntl(attempt, F_SETFL, fcntl(attempt, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+        if (connect(attempt, (const struct sockaddr*)endpoint.address, endpoint.length) < 0 && !ircRelay::Pending()) {
+            close(attempt);
+            continue;
+        }
+        attempts[attemptCount++] = attempt;
+        attemptTime = now + IRC_CONNECT_DELAY;
+        return true;
+    }
+    return false;
+}
+
+short IrcConnection::Complete(struct pollfd* pfds, size_t count) {
+    short revents = 0;
+
+    // the first attempt that connects wins, failed ones make room for the next address
+    for (size_t i = 0; i < count && fd == 0; i++) {
+        if (pfds[i].revents == 0) continue;
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        bool failed = getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, (char*)&error, &length) < 0 || error != 0;
+        for (size_t j = 0; j < attemptCount; j++) {
+            if (attempts[j] != pfds[i].fd) continue;
+            attempts[j] = attempts[--attemptCount];
+            break;
+        }
+
+        if (failed) {
+            bz_debugMessage(2, "Connection attempt to irc server failed");
+            close(pfds[i].fd);
+            Attempt(ircRelay::Now());
+        }
+        else {
+            fd = pfds[i].fd;
+            revents = pfds[i].revents;
+        }
+    }
+
+    if (fd != 0) {
+        for (size_t i = 0; i < attemptCount; i++) close(attempts[i]);
+        attemptCount = 0;
+
+        // put the transport on top of the connected socket
+#if defined(IRCRELAY_TLS)
+        if (active->networks[index].tls) transport.reset(new TlsTransport(fd, endpointHost, active->tlsVerify, &tlsSession));
+        else
+#endif
+        transport.reset(new PlainTransport(fd));
+        state = IRC_HANDSHAKING;
+        handshakeTime = ircRelay::Now();
+        if (!Secure()) revents = 0;
+    }
+    else if (attemptCount == 0) {
+        std::string debugMessage = "Connection to irc server " + endpointHost + " failed";
+        bz_debugMessage(1, debugMessage.c_str());
+        endpointExpires = 0;
+        Stop();
+    }
+    return revents;
+}
+
+bool IrcConnection::Secure() {
+    int ready = transport->Handshake();
+    if (ready < 0) {
+        std::string debugMessage = "Handshake with irc server " + endpointHost + " failed";
+        bz_debugMessage(1, debugMessage.c_str());
+        Stop();
+        return false;
+    }
+    if (ready == 0) return true;
+
+    if (active->networks[index].tls) {
+        metrics.tlsHandshakes++;
+        if (transport->Resumed()) metrics.tlsResumed++;
+        std::string debugMessage = "Handshake with irc server " + endpointHost + " took " + std::to_string((int)((ircRelay::Now() - handshakeTime) * 1000)) + " ms" + (transport->Resumed() ? ", session resumed" : "");
+        bz_debugMessage(2, debugMessage.c_str());
+    }
+    Login();
+    return true;
+}
+
+void IrcConnection::Login() {
+    const IrcNetwork& network = active->networks[index];
+
+    // send pass
+    if (network.pass != "") {
+        Send("PASS " + network.pass, 3);
+    }
+
+    // list the capabilities in the same burst, the server holds back the registration until the negotiation ends
+    negotiating = network.authType == "SASL";
+    saslOffered = false;
+    if (negotiating) {
+        Send("CAP LS 302", 3);
+    }
+
+    // send nick
+    nick = active->nick;
+    Send("NICK " + nick, 3);
+
+    // send user
+    Send("USER ircrelay 0 * :BZFlag ircRelay", 3);
+
+    // everything else is driven by the numerics of the server, up to the welcome
+    state = IRC_REGISTERING;
+    deadline = ircRelay::Now() + IRC_REGISTER_TIMEOUT;
+}
+
+void IrcConnection::Identify() {
+    const IrcNetwork& network = active->networks[index];
+    const std::string& ircNick = active->nick;
+    const std::string& ircAuthType = network.authType;
+    const std::string& ircAuthPass = network.authPass;
+
+    // send auth
+    bool identifying = false;
+    if (ircAuthType == "AuthServ") {
+        Send("PRIVMSG AuthServ :AUTH " + ircNick + " " + ircAuthPass, 3);
+        identifying = true;
+    }
+    if (ircAuthType == "NickServ") {
+        Send("PRIVMSG NickServ :IDENTIFY " + ircAuthPass, 3);
+        identifying = true;
+    }
+    if (ircAuthType == "Q") {
+        Send("PRIVMSG Q@CServe.quakenet.org :AUTH " + ircNick + " " + ircAuthPass, 3);
+        identifying = true;
+    }
+
+    // give the auth service a moment to answer before joining
+    if (identifying) {
+        state = IRC_IDENTIFYING;
+        deadline = ircRelay::Now() + IRC_IDENTIFY_TIMEOUT;
+        return;
+    }
+    Join();
+}
+
+void IrcConnection::Join() {
+    const IrcNetwork& network = active->networks[index];
+
+    // send join for all routed channels at once
+    std::string channels;
+    for (size_t i = 0; i < network.channels.size(); i++) {
+        if (i > 0) channels += ",";
+        channels += "#" + network.channels[i];
+    }
+    Send("JOIN " + channels, 3);
+
+    state = IRC_CONNECTED;
+    pingTime = ircRelay::Now() + IRC_PING_INTERVAL;
+    pingSent = 0;
+    bz_debugMessage(2, "Started ircRelay custom plugin");
+}
+
+void IrcConnection::Stop() {
+    bz_debugMessage(2, "Stopping ircRelay custom plugin");
+
+    // close transport, socket and pending attempts
+    if (transport) transport->Close();
+    transport.reset();
+    if (fd != 0) close(fd);
+    fd = 0;
+    for (size_t i = 0; i < attemptCount; i++) close(attempts[i]);
+    attemptCount = 0;
+    state = IRC_DISCONNECTED;
+    reader.Reset();
+    writeLength = 0;
+
+    std::string debugMessage = "Relayed " + std::to_string(metrics.outboundSent) + " of " + std::to_string(metrics.outboundQueued) + " queued lines, " + std::to_string(metrics.outboundDropped) + " dropped";
+    bz_debugMessage(3, debugMessage.c_str());
+
+    bz_debugMessage(2, "Stopped ircRelay custom plugin");
+}
+
+bool IrcConnection::Receive() {
+    while (fd != 0) {
+        size_t available;
+        char* space = reader.Space(available);
+        int r_len = transport->Read(space, available);
+        if (r_len == 0) return true;
+        if (r_len < 0) {
+            bz_debugMessage(1, "Connection lost to irc server");
+            return false;
+        }
+        reader.Fill(r_len);
+        metrics.inboundBytes += r_len;
+
+        // handle every complete line, an incomplete one stays in the reader until the next read
+        IrcMessage message;
+        while (reader.Next(message)) {
+            bz_debugMessage(4, message.line.data);
+            metrics.inboundReceived++;
+            if (capturing) ircRelay::Capture(CAPTURE_INBOUND, index, eNoTeam, eNoTeam, "", message.line.data, message.line.length);
+            Handle(message);
+        }
+    }
+    return false;
+}
+
+void IrcConnection::Handle(IrcMessage& message) {
+    // passing messages from the routed channels to BZFlag
+    if (message.command.Equals("PRIVMSG") && message.paramCount >= 2) {
+        IrcSlice target = message.params[0];
+        IrcSlice username = message.nick;
+        IrcSlice text = message.Text();
+
+        // only channels with an irc route get relayed
+        bool routed = false;
+        const IrcNetwork& network = active->networks[index];
+        for (size_t i = 0; i < network.relayed.size() && !routed; i++) {
+            const std::string& channel = network.relayed[i];
+            routed = target.length == channel.size() + 1 && target.data[0] == '#';
+            for (size_t j = 0; j < channel.size() && routed; j++) {
+                routed = tolower((unsigned char)target.data[j + 1]) == tolower((unsigned char)channel[j]);
+            }
+        }
+
+        // queries are answered in routed channels and in private messages to the relay
+        bool direct = target.length > 0 && target.data[0] != '#';
+        if (!routed && !direct) return;
+
+        // ctcp requests like VERSION or PING are meant for irc clients, only ACTION is chat
+        if (text.length > 0 && text.data[0] == '\001' && !text.StartsWith("\001ACTION ")) {
+            std::string debugMessage = "CTCP request from " + std::string(username.data, username.length) + " got dropped";
+            bz_debugMessage(3, debugMessage.c_str());
+            return;
+        }
+
+        // check if username is on the ignore list
+        std::shared_ptr<const IrcConfig> ircConfig = ircRelay::Config();
+        bool ignored = !ircConfig->ignores.Empty() && ircConfig->ignores.Matches(message.nick, message.user, message.host);
+
+        if (!ignored && text.length > 0 && text.data[0] == '!' && Query(username, text)) return;
+        if (!routed) return;
+
+        // filter the text before anyone gets to see it
+        std::string filtered;
+        FilterAction action = ignored || ircConfig->filter->Empty() ? FILTER_PASS : ircConfig->filter->Apply(text.data, text.length, filtered);
+        if (action == FILTER_DROP) {
+            std::string debugMessage = "Message from " + std::string(username.data, username.length) + " got filtered";
+            bz_debugMessage(3, debugMessage.c_str());
+            return;
+        }
+        if (action != FILTER_PASS) {
+            text.data = filtered.c_str();
+            text.length = filtered.size();
+        }
+
+        // pass the IRC message on to the game thread, which sends it into the BZFlag chat
+        if (!ignored) {
+            bz_eMessageType type = eChatMessage;
+            const char* separator = ": ";
+            if (text.length > 8 && text.StartsWith("\001ACTION ")) {
+                text = text.Substr(8, text.length - 8);
+                if (text.length > 0 && text.data[text.length - 1] == '\001') text.length--;
+                type = eActionMessage;
+                separator = " ";
+            }
+
+            // irc formatting becomes bzflag colours, only text with control bytes or utf-8 gets copied
+            std::string translated;
+            if (IrcText::FromIrc(text.data, text.length, translated)) {
+                text.data = translated.c_str();
+                text.length = translated.size();
+            }
+            ircRelay::Deliver(type, username, separator, text);
+        }
+        else {
+            std::string debugMessage = "Message from " + std::string(username.data, username.length) + " got ignored";
+            bz_debugMessage(3, debugMessage.c_str());
+        }
+    }
+
+    // respond to pings
+    if (message.command.Equals("PING")) {
+        IrcSlice token = message.Text();
+        std::string pong = "PONG :" + std::string(token.data, token.length);
+        Send(pong, 4);
+        pingCount++;
+    }
+
+    // answer to our own ping
+    if (message.command.Equals("PONG") && pingSent > 0) {
+        metrics.pingLatency.Record(ircRelay::Now() - pingSent);
+        pingSent = 0;
+    }
+
+    // continue the registration
+    if (state == IRC_REGISTERING) {
+        const IrcNetwork& network = active->networks[index];
+
+        // sasl negotiation
+        if (negotiating && message.command.Equals("CAP") && message.paramCount >= 3) {
+            if (message.params[1].Equals("LS")) {
+                // a long list comes in several lines, all but the last one marked with an asterisk
+                bool more = message.paramCount >= 4 && message.params[2].Equals("*");
+                IrcSlice offered = message.Text();
+                for (size_t i = 0; i < offered.length;) {
+                    size_t end = i;
+                    while (end < offered.length && offered.data[end] != ' ') end++;
+                    IrcSlice capability = offered.Substr(i, end - i);
+                    if (capability.Equals("sasl") || capability.StartsWith("sasl=")) saslOffered = true;
+                    i = end + 1;
+                }
+                if (!more) {
+                    if (saslOffered) Send("CAP REQ :sasl", 3);
+                    else { bz_debugMessage(1, "IRC server does not support SASL"); Send("CAP END", 3); negotiating = false; }
+                }
+            }
+            else if (message.params[1].Equals("ACK")) Send("AUTHENTICATE PLAIN", 3);
+            else if (message.params[1].Equals("NAK")) { bz_debugMessage(1, "IRC server does not support SASL"); Send("CAP END", 3); negotiating = false; }
+        }
+        else if (negotiating && message.command.Equals("AUTHENTICATE") && message.paramCount >= 1 && message.params[0].Equals("+")) {
+            std::string credentials = ircRelay::Base64(active->nick + std::string(1, '\0') + active->nick + std::string(1, '\0') + network.authPass);
+            for (size_t i = 0; i < credentials.size(); i += 400) Send("AUTHENTICATE " + credentials.substr(i, 400), 4);
+            if (credentials.size() % 400 == 0) Send("AUTHENTICATE +", 4);
+        }
+        else if (negotiating && message.command.Equals("903")) {
+            bz_debugMessage(2, "Authenticated at irc server with SASL");
+            Send("CAP END", 3);
+            negotiating = false;
+        }
+        else if (negotiating && (message.command.Equals("902") || message.command.Equals("904") || message.command.Equals("905") || message.command.Equals("906") || message.command.Equals("908"))) {
+            bz_debugMessage(1, "Authentication at irc server with SASL failed");
+            Send("CAP END", 3);
+            negotiating = false;
+        }
+
+        // nick in use, so try another one
+        if (message.command.Equals("433")) {
+            nick += "_";
+            Send("NICK " + nick, 3);
+        }
+
+        // welcome, sasl is done by now, the other services need to be asked
+        if (message.command.Equals("001")) {
+            if (network.authType == "SASL") Join();
+            else Identify();
+        }
+    }
+    else if (state == IRC_IDENTIFYING && (message.command.Equals("900") || message.command.Equals("NOTICE") || message.command.Equals("PRIVMSG"))) {
+        Join();
+    }
+}
+
+bool IrcConnection::Query(IrcSlice nick, IrcSlice text) {
+    // the command is the first word of the message
+    auto command = [&text](const char* name) {
+        size_t length = strlen(name);
+        return text.StartsWith(name) && (text.length == length || text.data[length] == ' ');
+    };
+
+    QueryKind kind = QUERY_COUNT;
+    if (command("!players")) kind = QUERY_PLAYERS;
+    else if (command("!score")) kind = QUERY_SCORE;
+    else if (command("!status")) kind = QUERY_STATUS;
+    else if (!command("!history")) return false;
+
+    // every user gets one answer per interval, further queries are swallowed
+    std::string requester(nick.data, nick.length);
+    double now = ircRelay::Now();
+    std::unordered_map<std::string, double>::iterator last = queried.find(requester);
+    if (last != queried.end() && now - last->second < IRC_QUERY_INTERVAL) return true;
+    if (queried.size() >= 64) {
+        for (std::unordered_map<std::string, double>::iterator it = queried.begin(); it != queried.end();) {
+            if (now - it->second >= IRC_QUERY_INTERVAL) it = queried.erase(it);
+            else ++it;
+        }
+    }
+    queried[requester] = now;
+
+    // the history belongs to the game thread, so it answers on its next tick
+    if (kind == QUERY_COUNT) {
+        if (requester.size() >= IRC_CHANNEL_SIZE) return true;
+        RingQueue<HistoryRequest>::Cell* cell = historyRequests.Claim();
+        if (cell == nullptr) return true;
+        cell->data.network = index;
+        cell->data.page = text.length > 9 ? atoi(std::string(text.data + 9, text.length - 9).c_str()) : 1;
+        memcpy(cell->data.nick, requester.c_str(), requester.size() + 1);
+        historyRequests.Commit(cell);
+        return true;
+    }
+
+    std::vector<std::string> lines;
+    if (!ircRelay::Answer(kind, lines)) return true;
+
+    // the answers go through the outbound queue, so a crowd of users asking can not flood the server
+    for (size_t i = 0; i < lines.size(); i++) {
+        RelayLine* line = ircRelay::Allocate();
+        if (line == nullptr) break;
+
+        LineWriter writer(line->text, IRC_TEXT_SIZE);
+        writer.Append("NOTICE ").Append(requester).Append(" :").Append(active->prefix).Append(lines[i]);
+        line->kind = OUTBOUND_COMMAND;
+        line->length = writer.Length();
+        line->name[0] = '\0';
+        if (!Enqueue(line, "", active->overflow)) ircRelay::Release(line);
+    }
+    return true;
+}
+
+char* IrcConnection::Reserve(size_t length) {
+    // the line and its line break are appended to the pending data, the worker writes it as soon as the socket is writable
+    if (writeLength + length + 2 > IRC_BUFFER_SIZE) {
+        bz_debugMessage(2, "Sending to irc server skipped, because the send buffer is full");
+        metrics.outboundDropped++;
+        return nullptr;
+    }
+    return writeBuffer + writeLength;
+}
+
+void IrcConnection::Commit(size_t length, int debugLevel) {
+    // the line gets logged where it is, the terminator only holds the place of the line break
+    char* line = writeBuffer + writeLength;
+    line[length] = '\0';
+    bz_debugMessage(debugLevel, line);
+    memcpy(line + length, "\r\n", 2);
+    writeLength += length + 2;
+}
+
+void IrcConnection::Send(const char* data, size_t length, int debugLevel) {
+    char* line = Reserve(length);
+    if (line == nullptr) return;
+    memcpy(line, data, length);
+    Commit(length, debugLevel);
+}
+
+void IrcConnection::Send(const std::string& data, int debugLevel) {
+    Send(data.c_str(), data.size(), debugLevel);
+}
+
+bool IrcConnection::Write() {
+    while (fd != 0 && writeLength > 0) {
+        int w_len = transport->Write(writeBuffer, writeLength);
+        if (w_len == 0) return true;
+        if (w_len < 0) {
+            bz_debugMessage(1, "Connection lost to irc server");
+            return false;
+        }
+        memmove(writeBuffer, writeBuffer + w_len, writeLength - w_len);
+        writeLength -= w_len;
+        metrics.outboundBytes += w_len;
+    }
+    return true;
+}
+
+void IrcConnection::Drain() {
+    std::shared_ptr<const IrcConfig> ircConfig = ircRelay::Config();
+
+    // refill the token bucket
+    double now = ircRelay::Now();
+    tokens += (now - tokensTime) * ircConfig->rate;
+    if (tokens > ircConfig->burst) tokens = ircConfig->burst;
+    tokensTime = now;
+
+    // move queued lines into the send buffer, but keep room for pongs and other commands
+    while (tokens >= 1 && writeLength + 2 * IRC_TEXT_SIZE <= IRC_BUFFER_SIZE && Next(current)) {
+        // when more lines are waiting than we may send, joins and parts get summarized
+        if ((current.kind == OUTBOUND_JOIN || current.kind == OUTBOUND_PART) && outbound.Size() + spool.Size() + 1 > tokens) {
+            Summarize(current);
+        }
+        if (capturing) ircRelay::Capture(CAPTURE_OUTBOUND, index, eNoTeam, eNoTeam, current.name, current.text, current.length);
+        tokens -= Split(current.text, current.length);
+        metrics.outboundSent++;
+        metrics.outboundLatency.Record(now - current.created);
+    }
+
+    // summarize the lines that did not fit into the queue, in every channel that missed some
+    if (!holding && outbound.Size() == 0 && spool.Size() == 0 && coalesced > 0) {
+        std::lock_guard<std::mutex> lock(coalesceMutex);
+        unsigned int count = coalesced;
+        while (count > 0 && tokens >= 1 && writeLength + 2 * IRC_TEXT_SIZE <= IRC_BUFFER_SIZE) {
+            const CoalescedRoute& route = coalescedRoutes[--count];
+            Send("PRIVMSG #" + std::string(route.channel) + " :" + ircConfig->prefix + std::to_string(route.count) + " messages were not relayed", 3);
+            tokens -= 1;
+        }
+        coalesced = count;
+    }
+}
+
+void IrcConnection::Coalesce(const std::string& channel) {
+    // only a full queue gets here, so taking the lock costs nothing while lines flow
+    std::lock_guard<std::mutex> lock(coalesceMutex);
+    unsigned int count = coalesced;
+    for (unsigned int i = 0; i < count; i++) {
+        if (channel == coalescedRoutes[i].channel) {
+            coalescedRoutes[i].count++;
+            return;
+        }
+    }
+
+    // channels beyond the table only show up in the metrics
+    if (count == IRC_COALESCE_SIZE || channel.size() >= IRC_CHANNEL_SIZE) return;
+    memcpy(coalescedRoutes[count].channel, channel.c_str(), channel.size() + 1);
+    coalescedRoutes[count].count = 1;
+    coalesced = count + 1;
+}
+
+void IrcConnection::Spill(bool commands) {
+    RingQueue<OutboundEntry>::Cell* cell;
+    while ((cell = outbound.Acquire()) != nullptr) {
+        // commands are only worth keeping for the current connection
+        if (commands || cell->data.channel[0] != '\0') {
+            spool.Append(*cell->data.line, cell->data.channel);
+            metrics.outboundSpooled++;
+        }
+        else {
+            metrics.outboundDropped++;
+        }
+        ircRelay::Release(cell->data.line);
+        outbound.Release(cell);
+    }
+}
+
+bool IrcConnection::Next(OutboundLine& line) {
+    // a line that was looked at while summarizing goes first
+    if (holding) {
+        holding = false;
+        line.created = held.created;
+        line.kind = held.kind;
+        line.length = held.length;
+        memcpy(line.name, held.name, BZ_CALLSIGN_SIZE);
+        memcpy(line.text, held.text, held.length);
+        return true;
+    }
+
+    // while older lines wait in the spool or the queue backs up, new lines line up in the spool to keep their order
+    if (spooling && (spool.Size() > 0 || outbound.Size() > outbound.Capacity() / 2)) {
+        Spill(true);
+        return spool.Pop(line, active->spoolAge);
+    }
+
+    RingQueue<OutboundEntry>::Cell* cell = outbound.Acquire();
+    if (cell == nullptr) return false;
+
+    // commands go out as they are, everything else is sent to the channel of its route
+    RelayLine* relayLine = cell->data.line;
+    LineWriter writer(line.text, IRC_TEXT_SIZE);
+    if (cell->data.channel[0] != '\0') writer.Append("PRIVMSG #").Append(cell->data.channel).Append(" :");
+    writer.Append(relayLine->text, relayLine->length);
+    line.created = relayLine->created;
+    line.kind = relayLine->kind;
+    line.length = writer.Length();
+    memcpy(line.name, relayLine->name, BZ_CALLSIGN_SIZE);
+    ircRelay::Release(relayLine);
+    outbound.Release(cell);
+    return true;
+}
+
+void IrcConnection::Summarize(OutboundLine& line) {
+    OutboundKind kind = line.kind;
+    unsigned int count = 1;
+    unsigned int listed = 1;
+
+    // the header is everything up to the trailing parameter
+    size_t headerLength = 0;
+    for (size_t i = 0; i + 1 < line.length; i++) {
+        if (line.text[i] == ' ' && line.text[i + 1] == ':') {
+            headerLength = i + 2;
+            break;
+        }
+    }
+
+    char names[IRC_TEXT_SIZE];
+    LineWriter nameList(names, IRC_PAYLOAD_SIZE / 2);
+    nameList.Append(line.name);
+
+    // collect the following joins or parts of the same channel, the first other line is held back for later
+    while (!holding && Next(held)) {
+        if (held.kind != kind || held.length < headerLength || memcmp(held.text, line.text, headerLength) != 0) {
+            holding = true;
+            break;
+        }
+        count++;
+        metrics.outboundSent++;
+        if (nameList.Length() + strlen(held.name) + 2 < IRC_PAYLOAD_SIZE / 2) {
+            nameList.Append(", ").Append(held.name);
+            listed++;
+        }
+    }
+    if (count == 1) return;
+
+    LineWriter summary(line.text + headerLength, IRC_TEXT_SIZE - headerLength);
+    summary.Append(ircRelay::Config()->prefix).Append(std::to_string(count)).Append(kind == OUTBOUND_JOIN ? " players joined: " : " players left: ");
+    summary.Append(names, nameList.Length());
+    if (listed < count) summary.Append(" and ").Append(std::to_string(count - listed)).Append(" more");
+    line.length = headerLength + summary.Length();
+}
+
+int IrcConnection::Split(const char* text, size_t length) {
+    if (length <= IRC_PAYLOAD_SIZE) {
+        Send(text, length, 3);
+        return 1;
+    }
+
+    // the part up to the trailing parameter gets repeated on every line
+    size_t headerLength = 0;
+    for (size_t i = 0; i + 1 < length; i++) {
+        if (text[i] == ' ' && text[i + 1] == ':') {
+            headerLength = i + 2;
+            break;
+        }
+    }
+    if (headerLength == 0 || headerLength + 32 > IRC_PAYLOAD_SIZE) {
+        Send(text, length, 3);
+        return 1;
+    }
+
+    // actions need to be wrapped again on every line
+    const char* body = text + headerLength;
+    size_t bodyLength = length - headerLength;
+    bool action = bodyLength > 9 && memcmp(body, "\001ACTION ", 8) == 0 && body[bodyLength - 1] == '\001';
+    if (action) {
+        body += 8;
+        bodyLength -= 9;
+    }
+
+    int lines = 0;
+    size_t room = IRC_PAYLOAD_SIZE - headerLength - (action ? 9 : 0);
+    while (bodyLength > 0) {
+        size_t cut = bodyLength;
+        if (cut > room) {
+            cut = room;
+
+            // prefer splitting between words, but never inside of an UTF-8 character
+            size_t space = cut;
+            while (space > room - 32 && body[space] != ' ') space--;
+            if (body[space] == ' ') cut = space;
+            while (cut > 0 && ((unsigned char)body[cut] & 0xC0) == 0x80) cut--;
+            if (cut == 0) cut = room;
+        }
+
+        // every piece is put together right in the send buffer
+        size_t pieceLength = headerLength + cut + (action ? 9 : 0);
+        char* piece = Reserve(pieceLength);
+        if (piece != nullptr) {
+            LineWriter writer(piece, pieceLength);
+            writer.Append(text, headerLength);
+            if (action) writer.Append("\001ACTION ", 8);
+            writer.Append(body, cut);
+            if (action) writer.Append("\001", 1);
+            Commit(writer.Length(), 3);
+        }
+        lines++;
+
+        while (cut < bodyLength && body[cut] == ' ') cut++;
+        body += cut;
+        bodyLength -= cut;
+    }
+    return lines;
+}
+
+IrcHub::IrcHub() {
+    lockFd = -1;
+    listenFd = -1;
+    disabled = false;
+    nextAttempt = 0;
+    upstream.fd = -1;
+    upstream.readLength = 0;
+    upstream.writeLength = 0;
+}
+
+void IrcHub::Update(double now) {
+    // a changed path or tag starts the election over
+    std::shared_ptr<const IrcConfig> ircConfig = ircRelay::Config();
+    if (ircConfig->hub != path || ircConfig->hubTag != tag) {
+        Close();
+        path = ircConfig->hub;
+        tag = ircConfig->hubTag;
+        disabled = false;
+        nextAttempt = now;
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+        if (path != "") bz_debugMessage(1, "Sharing the irc connections skipped, because it is not supported on this platform");
+        disabled = true;
+#endif
+    }
+
+    // lines of the game thread go to the hub, or out on our own connections once this server became the hub
+    if (hubRole != HUB_CLIENT || upstream.fd >= 0) Forward();
+    if (upstream.fd >= 0 && upstream.writeLength > 0 && !Write(upstream)) Drop(upstream);
+
+    // whoever gets the lock is the hub, everyone else connects to it and takes over when it is gone
+    if (path == "" || disabled || hubRole == HUB_SERVER || upstream.fd >= 0 || now < nextAttempt) return;
+    nextAttempt = now + IRC_HUB_RETRY;
+    if (!Elect()) Join();
+}
+
+double IrcHub::Due(double now) const {
+    if (path == "" || disabled || hubRole == HUB_SERVER || upstream.fd >= 0) return now + 60;
+    return nextAttempt;
+}
+
+size_t IrcHub::Poll(struct pollfd* pfds) {
+    size_t count = 0;
+    if (listenFd >= 0) {
+        pfds[count].fd = listenFd;
+        pfds[count].events = POLLIN;
+        pfds[count].revents = 0;
+        count++;
+    }
+    if (upstream.fd >= 0) {
+        pfds[count].fd = upstream.fd;
+        pfds[count].events = POLLIN | (upstream.writeLength > 0 ? POLLOUT : 0);
+        pfds[count].revents = 0;
+        count++;
+    }
+    for (size_t i = 0; i < peers.size(); i++) {
+        pfds[count].fd = peers[i]->fd;
+        pfds[count].events = POLLIN | (peers[i]->writeLength > 0 ? POLLOUT : 0);
+        pfds[count].revents = 0;
+        count++;
+    }
+    return count;
+}
+
+void IrcHub::Process(struct pollfd* pfds, size_t count) {
+    // the descriptors are in the order of Poll, peers that joined in between are handled next time
+    size_t next = 0;
+    if (listenFd >= 0 && next < count && pfds[next].fd == listenFd) {
+        if (pfds[next].revents & POLLIN) Accept();
+        next++;
+    }
+    if (upstream.fd >= 0 && next < count && pfds[next].fd == upstream.fd) {
+        short revents = pfds[next].revents;
+        bool alive = true;
+        if (revents & (POLLIN | POLLHUP | POLLERR)) alive = Read(upstream);
+        if (alive && (revents & POLLOUT)) alive = Write(upstream);
+        if (!alive) Drop(upstream);
+        next++;
+    }
+    for (size_t i = 0; i < peers.size() && next < count; ) {
+        HubPeer& peer = *peers[i];
+        short revents = pfds[next].fd == peer.fd ? pfds[next].revents : 0;
+        next++;
+
+        bool alive = true;
+        if (revents & (POLLIN | POLLHUP | POLLERR)) alive = Read(peer);
+        if (alive && (revents & POLLOUT)) alive = Write(peer);
+        if (alive) { i++; continue; }
+
+        std::string debugMessage = "Server " + peer.tag + " left the irc hub";
+        bz_debugMessage(2, debugMessage.c_str());
+        Drop(peer);
+        peers.erase(peers.begin() + i);
+    }
+}
+
+bool IrcHub::Route(bz_eMessageType type, IrcSlice from, const char* separator, IrcSlice& text) {
+    // a message starting with @tag is only meant for that server
+    std::string target;
+    if (text.length > 1 && text.data[0] == '@') {
+        const char* space = (const char*)memchr(text.data, ' ', text.length);
+        if (space != nullptr) {
+            target.assign(text.data + 1, space - text.data - 1);
+            bool known = target == tag;
+            for (size_t i = 0; i < peers.size() && !known; i++) known = peers[i]->tag == target;
+            if (known) text = text.Substr(space - text.data + 1, text.length);
+            else target = "";
+        }
+    }
+    if (target == tag || peers.size() == 0) return true;
+
+    // the clients get the line as it is going to be shown
+    char line[IRC_LINE_SIZE];
+    LineWriter writer(line, sizeof(line));
+    writer.Append(from.data, from.length).Append(separator).Append(text.data, text.length);
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (peers[i]->tag == "" || (target != "" && peers[i]->tag != target)) continue;
+        if (!Frame(*peers[i], HUB_CHAT, (uint8_t)type, 0, "", 0, line, writer.Length())) metrics.inboundDropped++;
+    }
+    return target == "";
+}
+
+void IrcHub::Close() {
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+    for (size_t i = 0; i < peers.size(); i++) Drop(*peers[i]);
+    peers.clear();
+    Drop(upstream);
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(path.c_str());
+    }
+    if (lockFd >= 0) close(lockFd);
+#endif
+    listenFd = -1;
+    lockFd = -1;
+    hubRole = HUB_DIRECT;
+}
+
+bool IrcHub::Elect() {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    return false;
+#else
+    // the lock is held as long as this server is the hub, the system releases it when the process dies
+    std::string lockPath = path + ".lock";
+    if (lockFd < 0) lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT, 0600);
+    if (lockFd < 0) {
+        std::string debugMessage = "Sharing the irc connections skipped, because " + lockPath + " could not be opened";
+        bz_debugMessage(1, debugMessage.c_str());
+        disabled = true;
+        return true;
+    }
+    if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) return false;
+
+    // a socket left behind by a crashed hub is taken over
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        bz_debugMessage(1, "Sharing the irc connections skipped, because the hub path is too long");
+        close(lockFd);
+        lockFd = -1;
+        disabled = true;
+        return true;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    unlink(path.c_str());
+
+    // only the user of the servers may connect, anyone else could send lines to irc in their name
+    listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || chmod(path.c_str(), 0600) != 0 || listen(listenFd, IRC_HUB_SIZE) != 0) {
+        std::string debugMessage = "Sharing the irc connections failed, because " + path + " could not be bound";
+        bz_debugMessage(1, debugMessage.c_str());
+        if (listenFd >= 0) close(listenFd);
+        listenFd = -1;
+        flock(lockFd, LOCK_UN);
+        return false;
+    }
+    fcntl(listenFd, F_SETFL, O_NONBLOCK);
+
+    hubRole = HUB_SERVER;
+    std::string debugMessage = "Sharing the irc connections on " + path + " as hub";
+    bz_debugMessage(2, debugMessage.c_str());
+    return true;
+#endif
+}
+
+bool IrcHub::Join() {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    return false;
+#else
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size());
+
+    // a hub that is not listening yet leaves the role as it is, the election is held again on the next tick
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return false;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    // the connections go down once another server is the hub
+    hubRole = HUB_CLIENT;
+
+    upstream.fd = fd;
+    upstream.tag = "";
+    upstream.readLength = 0;
+    upstream.writeLength = 0;
+    Frame(upstream, HUB_HELLO, 0, 0, tag.c_str(), tag.size(), "", 0);
+
+    std::string debugMessage = "Sharing the irc connections on " + path + " as " + tag;
+    bz_debugMessage(2, debugMessage.c_str());
+    return true;
+#endif
+}
+
+void IrcHub::Accept() {
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+    int fd;
+    while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+        if (peers.size() >= IRC_HUB_SIZE) {
+            bz_debugMessage(1, "Server refused by the irc hub, because there are too many");
+            close(fd);
+            continue;
+        }
+#if defined(SO_PEERCRED)
+        // in case the socket got opened up some other way, servers of other users are turned away here as well
+        struct ucred credentials;
+        socklen_t credentialsLength = sizeof(credentials);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsLength) != 0 || credentials.uid != geteuid()) {
+            bz_debugMessage(1, "Server refused by the irc hub, because it runs as another user");
+            close(fd);
+            continue;
+        }
+#endif
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+
+        // the peer gets its tag with the hello, nothing is sent to it before
+        std::unique_ptr<HubPeer> peer(new HubPeer());
+        peer->fd = fd;
+        peer->readLength = 0;
+        peer->writeLength = 0;
+        peers.push_back(std::move(peer));
+    }
+#endif
+}
+
+void IrcHub::Forward() {
+    std::shared_ptr<const IrcConfig> ircConfig = ircRelay::Config();
+
+    // stop while the buffer is full, the rest waits in the queue
+    RingQueue<HubEntry>::Cell* cell;
+    while (upstream.writeLength + sizeof(HubFrame) + BZ_CALLSIGN_SIZE + IRC_TEXT_SIZE <= IRC_BUFFER_SIZE && (cell = hubQueue.Acquire()) != nullptr) {
+        RelayLine* line = cell->data.line;
+        RelayEvent event = cell->data.event;
+        hubQueue.Release(cell);
+
+        if (upstream.fd >= 0) {
+            Frame(upstream, HUB_LINE, (uint8_t)event, (uint8_t)line->kind, line->name, strlen(line->name), line->text, line->length);
+            ircRelay::Release(line);
+            continue;
+        }
+
+        // there is no hub to pass it to anymore, so it goes out like any other line
+        char name[BZ_CALLSIGN_SIZE];
+        memcpy(name, line->name, sizeof(name));
+        ircRelay::Relay(*ircConfig, event, line, line->kind, name, line->length);
+    }
+}
+
+void IrcHub::Drop(HubPeer& peer) {
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+    if (peer.fd >= 0) close(peer.fd);
+#endif
+    if (&peer == &upstream && peer.fd >= 0) {
+        // the hub is gone, so the next election decides who takes over
+        bz_debugMessage(2, "Lost the irc hub");
+        nextAttempt = 0;
+    }
+    peer.fd = -1;
+    peer.readLength = 0;
+    peer.writeLength = 0;
+}
+
+bool IrcHub::Read(HubPeer& peer) {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    return false;
+#else
+    while (true) {
+        ssize_t received = recv(peer.fd, peer.readBuffer + peer.readLength, IRC_BUFFER_SIZE - peer.readLength, 0);
+        if (received == 0) return false;
+        if (received < 0) return ircRelay::Pending();
+        peer.readLength += received;
+
+        // handle every complete frame, a frame that can never fit ends the connection
+        size_t offset = 0;
+        while (peer.readLength - offset >= sizeof(HubFrame)) {
+            HubFrame frame;
+            memcpy(&frame, peer.readBuffer + offset, sizeof(HubFrame));
+            size_t size = sizeof(HubFrame) + frame.nameLength + frame.length;
+            if (frame.length > IRC_TEXT_SIZE) return false;
+            if (peer.readLength - offset < size) break;
+
+            char name[256];
+            char text[IRC_TEXT_SIZE + 1];
+            memcpy(name, peer.readBuffer + offset + sizeof(HubFrame), frame.nameLength);
+            name[frame.nameLength] = '\0';
+            memcpy(text, peer.readBuffer + offset + sizeof(HubFrame) + frame.nameLength, frame.length);
+            text[frame.length] = '\0';
+            offset += size;
+            Handle(peer, frame, name, text);
+        }
+        memmove(peer.readBuffer, peer.readBuffer + offset, peer.readLength - offset);
+        peer.readLength -= offset;
+    }
+#endif
+}
+
+bool IrcHub::Write(HubPeer& peer) {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    return false;
+#else
+    while (peer.writeLength > 0) {
+        ssize_t sent = send(peer.fd, peer.writeBuffer, peer.writeLength, MSG_NOSIGNAL);
+        if (sent < 0) return ircRelay::Pending();
+        memmove(peer.writeBuffer, peer.writeBuffer + sent, peer.writeLength - sent);
+        peer.writeLength -= sent;
+    }
+    return true;
+#endif
+}
+
+bool IrcHub::Frame(HubPeer& peer, HubFrameType type, uint8_t event, uint8_t kind, const char* name, size_t nameLength, const char* text, size_t length) {
+    if (peer.fd < 0) return false;
+    if (nameLength > 255) nameLength = 255;
+    if (length > IRC_TEXT_SIZE) length = IRC_TEXT_SIZE;
+
+    // a peer that does not keep up loses the frame, instead of holding up the worker
+    size_t size = sizeof(HubFrame) + nameLength + length;
+    if (peer.writeLength + size > IRC_BUFFER_SIZE) return false;
+
+    HubFrame frame;
+    frame.length = (uint16_t)length;
+    frame.type = (uint8_t)type;
+    frame.event = event;
+    frame.kind = kind;
+    frame.nameLength = (uint8_t)nameLength;
+    frame.reserved = 0;
+    memcpy(peer.writeBuffer + peer.writeLength, &frame, sizeof(HubFrame));
+    memcpy(peer.writeBuffer + peer.writeLength + sizeof(HubFrame), name, nameLength);
+    memcpy(peer.writeBuffer + peer.writeLength + sizeof(HubFrame) + nameLength, text, length);
+    peer.writeLength += size;
+    return true;
+}
+
+void IrcHub::Handle(HubPeer& peer, const HubFrame& frame, const char* name, const char* text) {
+    if (frame.type == HUB_HELLO && &peer != &upstream) {
+        peer.tag = name;
+        std::string debugMessage = "Server " + peer.tag + " joined the irc hub";
+        bz_debugMessage(2, debugMessage.c_str());
+    }
+    else if (frame.type == HUB_LINE && &peer != &upstream && hubRole == HUB_SERVER) {
+        // the line was formatted by the other server, the routes of the hub decide where it goes
+        if (frame.event > RELAY_GAME || frame.event == RELAY_IRC || frame.kind > OUTBOUND_PART) return;
+        RelayLine* line = ircRelay::Allocate();
+        if (line == nullptr) return;
+        memcpy(line->text, text, frame.length);
+        ircRelay::Relay(*ircRelay::Config(), (RelayEvent)frame.event, line, (OutboundKind)frame.kind, name, frame.length);
+    }
+    else if (frame.type == HUB_CHAT && &peer == &upstream) {
+        IrcSlice line = { text, frame.length };
+        IrcSlice empty = { text, 0 };
+        metrics.inboundReceived++;
+        ircRelay::Deliver((bz_eMessageType)frame.event, line, "", empty);
+    }
+}
+
+void ircRelay::Wake() {
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+    if (wakeFds[1] != 0 && !woken.exchange(true)) {
+        char signal = 1;
+        if (write(wakeFds[1], &signal, 1) < 0) woken = false;
+    }
+#endif
+}
+
+bool ircRelay::Pending() {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    int error = WSAGetLastError();
+    return error == WSAEWOULDBLOCK || error == WSAEINPROGRESS;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS || errno == EINTR;
+#endif
+}
+
+bool ircRelay::Resolve(const IrcResolve& resolve) {
+    RingQueue<IrcResolve>::Cell* cell = resolveRequests.Claim();
+    if (cell == nullptr) return false;
+    cell->data = resolve;
+    resolveRequests.Commit(cell);
+
+    // taking the lock once makes sure the resolver is either waiting or going to see the request
+    {
+        std::lock_guard<std::mutex> lock(resolveMutex);
+    }
+    resolveSignal.notify_one();
+    return true;
+}
+
+// keeps the order of the system, but alternates the address families, so a broken one does not hold up the other
+template <typename Node>
+static void Order(IrcResolve& resolve, const Node* first) {
+    const Node* families[2][IRC_ADDRESS_SIZE];
+    size_t sizes[2] = { 0, 0 };
+    for (const Node* node = first; node != NULL; node = node->ai_next) {
+        if (node->ai_addrlen > sizeof(IrcEndpoint::address)) continue;
+        int family = node->ai_family == first->ai_family ? 0 : 1;
+        if (sizes[family] < IRC_ADDRESS_SIZE) families[family][sizes[family]++] = node;
+    }
+
+    resolve.count = 0;
+    for (size_t i = 0; i < IRC_ADDRESS_SIZE && resolve.count < IRC_ADDRESS_SIZE; i++) {
+        for (int family = 0; family < 2 && resolve.count < IRC_ADDRESS_SIZE; family++) {
+            if (i >= sizes[family]) continue;
+            IrcEndpoint& endpoint = resolve.endpoints[resolve.count++];
+            endpoint.family = families[family][i]->ai_family;
+            endpoint.length = families[family][i]->ai_addrlen;
+            memcpy(endpoint.address, families[family][i]->ai_addr, endpoint.length);
+        }
+    }
+}
+
+bool ircRelay::Lookup(IrcResolve& resolve) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    resolve.count = 0;
+    struct addrinfo* results = NULL;
+    std::string port = std::to_string(resolve.port);
+    if (getaddrinfo(resolve.host, port.c_str(), &hints, &results) != 0) return false;
+    Order(resolve, results);
+    freeaddrinfo(results);
+    return resolve.count > 0;
+}
+
+bool ircRelay::Query(ares_channel channel, IrcResolve& resolve) {
+    struct ares_addrinfo_hints hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = ARES_AI_ADDRCONFIG;
+
+    resolve.count = 0;
+    IrcLookup lookup;
+    lookup.resolve = &resolve;
+    lookup.done = false;
+    std::string port = std::to_string(resolve.port);
+    ares_getaddrinfo(channel, resolve.host, port.c_str(), &hints, Answered, &lookup);
+
+    // c-ares only works while it gets polled, so the lookup can be given up between two polls
+    while (!lookup.done) {
+        if (fc) {
+            ares_cancel(channel);
+            break;
+        }
+
+        ares_socket_t sockets[ARES_GETSOCK_MAXNUM];
+        struct pollfd fds[ARES_GETSOCK_MAXNUM];
+        int count = 0;
+        int bits = ares_getsock(channel, sockets, ARES_GETSOCK_MAXNUM);
+        for (int i = 0; i < ARES_GETSOCK_MAXNUM; i++) {
+            if (!ARES_GETSOCK_READABLE(bits, i) && !ARES_GETSOCK_WRITABLE(bits, i)) continue;
+            fds[count].fd = sockets[i];
+            fds[count].events = (ARES_GETSOCK_READABLE(bits, i) ? POLLIN : 0) | (ARES_GETSOCK_WRITABLE(bits, i) ? POLLOUT : 0);
+            fds[count].revents = 0;
+            count++;
+        }
+
+        struct timeval limit = { 0, 100000 };
+        struct timeval buffer;
+        struct timeval* wait = ares_timeout(channel, &limit, &buffer);
+        int timeout = (int)(wait->tv_sec * 1000 + wait->tv_usec / 1000);
+        if (count == 0) {
+            Wait(0, timeout > 0 ? timeout : 1);
+            ares_process_fd(channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+            continue;
+        }
+        if (poll(fds, count, timeout) <= 0) {
+            ares_process_fd(channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            ares_socket_t readable = fds[i].revents & (POLLIN | POLLERR | POLLHUP) ? fds[i].fd : ARES_SOCKET_BAD;
+            ares_socket_t writable = fds[i].revents & POLLOUT ? fds[i].fd : ARES_SOCKET_BAD;
+            if (readable != ARES_SOCKET_BAD || writable != ARES_SOCKET_BAD) ares_process_fd(channel, readable, writable);
+        }
+    }
+    return resolve.count > 0;
+}
+
+void ircRelay::Answered(void* arg, int status, int timeouts, struct ares_addrinfo* result) {
+    IrcLookup* lookup = (IrcLookup*)arg;
+    lookup->done = true;
+    if (status != ARES_SUCCESS || result == NULL) {
+        if (status != ARES_ECANCELLED && status != ARES_EDESTRUCTION) bz_debugMessage(3, ("Resolving irc server failed: " + std::string(ares_strerror(status))).c_str());
+        if (result != NULL) ares_freeaddrinfo(result);
+        return;
+    }
+    Order(*lookup->resolve, result->nodes);
+    ares_freeaddrinfo(result);
+}
+
+RelayLine* ircRelay::Allocate() {
+    RingQueue<RelayLine*>::Cell* cell = relayPool.Acquire();
+    if (cell == nullptr) {
+        metrics.outboundDropped++;
+        return nullptr;
+    }
+
+    RelayLine* line = cell->data;
+    relayPool.Release(cell);
+    line->references = 1;
+    line->created = Now();
+    return line;
+}
+
+void ircRelay::Release(RelayLine* line) {
+    if (line->references.fetch_sub(1) > 1) return;
+
+    // the last reference is gone, so the line goes back into the pool
+    RingQueue<RelayLine*>::Cell* cell = relayPool.Claim();
+    if (cell == nullptr) return;
+    cell->data = line;
+    relayPool.Commit(cell);
+}
+
+void ircRelay::Relay(const IrcConfig& ircConfig, RelayEvent event, RelayLine* line, OutboundKind kind, const char* name, size_t length) {
+    size_t nameLength = strlen(name) < BZ_CALLSIGN_SIZE ? strlen(name) : BZ_CALLSIGN_SIZE - 1;
+    memcpy(line->name, name, nameLength);
+    line->name[nameLength] = '\0';
+    line->kind = kind;
+    line->length = length;
+
+    // another server owns the connections, the worker passes the line on to it
+    if (hubRole == HUB_CLIENT) {
+        RingQueue<HubEntry>::Cell* cell = hubQueue.Claim();
+        if (cell == nullptr) {
+            metrics.outboundDropped++;
+            Release(line);
+            return;
+        }
+        cell->data.line = line;
+        cell->data.event = event;
+        hubQueue.Commit(cell);
+        metrics.outboundQueued++;
+        Wake();
+        return;
+    }
+
+    // every route shares the same formatted line, each one holding a reference until it got sent
+    for (size_t i = 0; i < ircConfig.routes.size(); i++) {
+        const IrcRoute& route = ircConfig.routes[i];
+        if (route.event != event) continue;
+
+        // without a connection or a spool the line has nowhere to go, which counts as dropped like a full queue
+        if (!connections[route.network]->Accepting()) {
+            metrics.outboundDropped++;
+            continue;
+        }
+
+        line->references++;
+        if (!connections[route.network]->Enqueue(line, route.channel, ircConfig.overflow)) Release(line);
+    }
+    Release(line);
+    Wake();
+}
+
+void ircRelay::Queue(std::string data) {
+    std::shared_ptr<const IrcConfig> ircConfig = Config();
+    RelayLine* line = Allocate();
+    if (line == nullptr) return;
+
+    // commands go to every connection, without a channel
+    size_t length = data.size() < IRC_TEXT_SIZE ? data.size() : IRC_TEXT_SIZE;
+    memcpy(line->text, data.c_str(), length);
+    line->kind = OUTBOUND_COMMAND;
+    line->length = length;
+    line->name[0] = '\0';
+    for (size_t i = 0; i < ircConfig->networks.size(); i++) {
+        if (!connections[i]->Connected()) continue;
+
+        line->references++;
+        if (!connections[i]->Enqueue(line, "", ircConfig->overflow)) Release(line);
+    }
+    Release(line);
+    Wake();
+}
+
+std::string ircRelay::Base64(const std::string& data) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string encoded;
+    for (size_t i = 0; i < data.size(); i += 3) {
+        unsigned int chunk = (unsigned char)data[i] << 16;
+        if (i + 1 < data.size()) chunk |= (unsigned char)data[i + 1] << 8;
+        if (i + 2 < data.size()) chunk |= (unsigned char)data[i + 2];
+        encoded += alphabet[(chunk >> 18) & 63];
+        encoded += alphabet[(chunk >> 12) & 63];
+        encoded += i + 1 < data.size() ? alphabet[(chunk >> 6) & 63] : '=';
+        encoded += i + 2 < data.size() ? alphabet[chunk & 63] : '=';
+    }
+    return encoded;
+}
+
+RosterEntry* ircRelay::Player(int playerID) {
+    if (playerID < 0 || playerID >= IRC_ROSTER_SIZE) return nullptr;
+    RosterEntry& player = roster[playerID];
+    if (player.active) return &player;
+
+    // players the roster missed are looked up once and kept from then on
+    bz_BasePlayerRecord* record = bz_getPlayerByIndex(playerID);
+    if (record == NULL) return nullptr;
+    Enter(playerID, record);
+    bz_freePlayerRecord(record);
+    return player.active ? &player : nullptr;
+}
+
+void ircRelay::Enter(int playerID, bz_BasePlayerRecord* record) {
+    if (playerID < 0 || playerID >= IRC_ROSTER_SIZE || record == NULL) return;
+    RosterEntry& player = roster[playerID];
+    player.Assign(record->callsign.c_str(), record->team, record->ipAddress.c_str());
+    player.wins = record->wins;
+    player.losses = record->losses;
+    player.teamKills = record->teamKills;
+    rosterChanged = true;
+}
+
+void ircRelay::Publish() {
+    rosterChanged = false;
+    std::shared_ptr<const IrcSnapshot> previous = std::atomic_load(&snapshot);
+    std::shared_ptr<IrcSnapshot> next = std::make_shared<IrcSnapshot>();
+    next->version = previous ? previous->version + 1 : 1;
+    next->published = Now();
+    next->uptime = bz_getCurrentTime();
+    next->gameType = bz_getGameType();
+    next->description = bz_getPublicDescription().c_str();
+
+    for (int i = 0; i < IRC_ROSTER_SIZE; i++) {
+        const RosterEntry& player = roster[i];
+        if (!player.active || player.callsign[0] == '\0') continue;
+
+        SnapshotPlayer entry;
+        memcpy(entry.callsign, player.callsign, BZ_CALLSIGN_SIZE);
+        entry.team = player.team;
+        entry.wins = player.wins;
+        entry.losses = player.losses;
+        entry.teamKills = player.teamKills;
+        next->players.push_back(entry);
+    }
+    for (int team = eRogueTeam; team <= ePurpleTeam; team++) {
+        next->teamWins[team] = team == eRogueTeam ? 0 : bz_getTeamWins((bz_eTeamType)team);
+        next->teamLosses[team] = team == eRogueTeam ? 0 : bz_getTeamLosses((bz_eTeamType)team);
+    }
+
+    // readers keep the snapshot they loaded, the old one goes away with its last reader
+    std::atomic_store(&snapshot, std::shared_ptr<const IrcSnapshot>(next));
+}
+
+void ircRelay::Collect(DigestKind kind, const RosterEntry* player, int target, double duration) {
+    RingQueue<DigestEvent>::Cell* cell = digestQueue.Claim();
+    if (cell == nullptr) return;
+
+    DigestEvent& event = cell->data;
+    event.kind = kind;
+    event.team = player != nullptr ? player->team : eNoTeam;
+    event.target = target;
+    event.duration = duration;
+    memcpy(event.name, player != nullptr ? player->callsign : "", player != nullptr ? BZ_CALLSIGN_SIZE : 1);
+    digestQueue.Commit(cell);
+
+    // kills wait for the end of their window, everything else goes out right away
+    if (kind != DIGEST_KILL) Wake();
+}
+
+double ircRelay::Aggregate(double now) {
+    std::shared_ptr<const IrcConfig> ircConfig = Config();
+
+    // one line with the number of kills and the best killers of the window
+    auto summarize = [&ircConfig](double now) {
+        std::sort(digest.killers.begin(), digest.killers.end(), [](const DigestScore& a, const DigestScore& b) { return a.kills > b.kills; });
+        RelayLine* line = Allocate();
+        if (line != nullptr) {
+            LineWriter writer(line->text, IRC_TEXT_SIZE);
+            writer.Append(ircConfig->prefix).Append(std::to_string(digest.kills)).Append(digest.kills == 1 ? " kill" : " kills");
+            writer.Append(" in the last ").Append(std::to_string((int)(now - digest.windowStart + 0.5))).Append(" seconds");
+            for (size_t i = 0; i < digest.killers.size() && i < 5; i++) {
+                const DigestScore& score = digest.killers[i];
+                writer.Append(i == 0 ? ", top: " : ", ").Append(GetTeamStyle(score.team).color).Append(score.callsign).Append("\017 ").Append(std::to_string(score.kills));
+            }
+            Relay(*ircConfig, RELAY_GAME, line, OUTBOUND_CHAT, "", writer.Length());
+        }
+        digest.kills = 0;
+        digest.killers.clear();
+    };
+
+    RingQueue<DigestEvent>::Cell* cell;
+    while ((cell = digestQueue.Acquire()) != nullptr) {
+        DigestEvent event = cell->data;
+        digestQueue.Release(cell);
+
+        // the window opens with its first kill
+        if (event.kind == DIGEST_KILL) {
+            if (digest.kills == 0) digest.windowStart = now;
+            digest.kills++;
+            if (event.name[0] == '\0') continue;
+
+            size_t i = 0;
+            while (i < digest.killers.size() && digest.killers[i].callsign != event.name) i++;
+            if (i == digest.killers.size()) digest.killers.push_back(DigestScore { event.name, event.team, 0 });
+            digest.killers[i].team = event.team;
+            digest.killers[i].kills++;
+            continue;
+        }
+
+        // the kills of a match get summarized before its end
+        if (event.kind == DIGEST_END && digest.kills > 0) summarize(now);
+
+        RelayLine* line = Allocate();
+        if (line == nullptr) continue;
+        LineWriter writer(line->text, IRC_TEXT_SIZE);
+        writer.Append(ircConfig->prefix);
+        if (event.kind == DIGEST_CAPTURE) {
+            const TeamStyle& style = GetTeamStyle(event.target);
+            writer.Append(GetTeamStyle(event.team).color).Append(event.name).Append("\017 captured the flag of the ").Append(style.color).Append(style.team).Append("\017");
+        }
+        else if (event.kind == DIGEST_START) {
+            writer.Append("The match started");
+            if (event.duration > 0) writer.Append(", it lasts ").Append(std::to_string((int)(event.duration / 60 + 0.5))).Append(" minutes");
+        }
+        else {
+            writer.Append("The match is over");
+        }
+        Relay(*ircConfig, RELAY_GAME, line, OUTBOUND_CHAT, event.name, writer.Length());
+    }
+
+    if (digest.kills > 0 && now >= digest.windowStart + ircConfig->digestWindow) summarize(now);
+    return digest.kills > 0 ? digest.windowStart + ircConfig->digestWindow : now + 1;
+}
+
+bool ircRelay::Answer(QueryKind kind, std::vector<std::string>& lines) {
+    static const char* gameTypes[] = { "Team FFA", "CTF", "Rabbit Chase", "Open FFA" };
+
+    std::shared_ptr<const IrcSnapshot> current = std::atomic_load(&snapshot);
+    if (!current) return false;
+
+    // the answers are formatted once per snapshot, no matter how many users ask
+    if (queryCache.version != current->version) {
+        for (size_t i = 0; i < QUERY_COUNT; i++) queryCache.answers[i].clear();
+        queryCache.version = current->version;
+    }
+
+    std::vector<std::string>& answer = queryCache.answers[kind];
+    if (answer.empty()) {
+        // lists are split into lines that fit into one irc message
+        auto list = [&answer](const std::string& title, const std::vector<std::string>& entries) {
+            std::string line = title;
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (line.size() > title.size() && line.size() + entries[i].size() + 2 > IRC_PAYLOAD_SIZE) {
+                    answer.push_back(line);
+                    line = title;
+                }
+                if (line.size() > title.size()) line += ", ";
+                line += entries[i];
+            }
+            answer.push_back(line);
+        };
+
+        std::vector<const SnapshotPlayer*> playing;
+        std::vector<std::string> observers;
+        for (size_t i = 0; i < current->players.size(); i++) {
+            const SnapshotPlayer& player = current->players[i];
+            if (player.team == eObservers) observers.push_back(player.callsign);
+            else playing.push_back(&player);
+        }
+
+        if (kind == QUERY_PLAYERS) {
+            std::vector<std::string> entries;
+            for (size_t i = 0; i < playing.size(); i++) {
+                const SnapshotPlayer& player = *playing[i];
+                entries.push_back(std::string(GetTeamStyle(player.team).color) + player.callsign + "\017 " + std::to_string(player.wins) + "/" + std::to_string(player.losses));
+            }
+            if (entries.empty()) answer.push_back("Nobody is playing right now");
+            else list("Players (" + std::to_string(entries.size()) + "): ", entries);
+            if (!observers.empty()) list("Observers (" + std::to_string(observers.size()) + "): ", observers);
+        }
+        else if (kind == QUERY_SCORE) {
+            std::vector<std::string> teams;
+            for (int team = eRedTeam; team <= ePurpleTeam; team++) {
+                bool manned = false;
+                for (size_t i = 0; i < playing.size() && !manned; i++) manned = playing[i]->team == team;
+                if (!manned && current->teamWins[team] == 0 && current->teamLosses[team] == 0) continue;
+                teams.push_back(std::string(GetTeamStyle(team).color) + GetTeamStyle(team).team + "\017 " + std::to_string(current->teamWins[team]) + "/" + std::to_string(current->teamLosses[team]));
+            }
+            if (!teams.empty()) list("Teams: ", teams);
+
+            std::sort(playing.begin(), playing.end(), [](const SnapshotPlayer* a, const SnapshotPlayer* b) {
+                return a->wins - a->losses > b->wins - b->losses;
+            });
+            std::vector<std::string> leaders;
+            for (size_t i = 0; i < playing.size() && i < 5; i++) {
+                const SnapshotPlayer& player = *playing[i];
+                int score = player.wins - player.losses;
+                leaders.push_back(std::string(GetTeamStyle(player.team).color) + player.callsign + "\017 " + (score > 0 ? "+" : "") + std::to_string(score) + " (" + std::to_string(player.wins) + "/" + std::to_string(player.losses) + ")");
+            }
+            if (!leaders.empty()) list("Top: ", leaders);
+            if (answer.empty()) answer.push_back("There are no scores yet");
+        }
+        else {
+            std::string line = current->description.empty() ? "" : current->description + " | ";
+            line += current->gameType >= 0 && current->gameType < (int)(sizeof(gameTypes) / sizeof(gameTypes[0])) ? gameTypes[current->gameType] : "Unknown game";
+            line += " | " + std::to_string(playing.size()) + (playing.size() == 1 ? " player, " : " players, ");
+            line += std::to_string(observers.size()) + (observers.size() == 1 ? " observer" : " observers");
+            answer.push_back(line);
+        }
+    }
+
+    lines = answer;
+
+    // the uptime keeps running between snapshots, so it is added to every answer
+    if (kind == QUERY_STATUS) {
+        long uptime = (long)(current->uptime + Now() - current->published);
+        char text[64];
+        if (uptime >= 86400) snprintf(text, sizeof(text), " | up %ldd %ldh", uptime / 86400, uptime % 86400 / 3600);
+        else snprintf(text, sizeof(text), " | up %ldh %ldm", uptime / 3600, uptime % 3600 / 60);
+        lines.back() += text;
+    }
+    return true;
+}
+
+void ircRelay::Recall(int playerID, size_t page, size_t lines) {
+    if (playerID < 0 || playerID >= IRC_ROSTER_SIZE) return;
+
+    // a new request replaces the one still running, page 0 just cancels it
+    HistoryReplay& replay = replays[playerID];
+    if (replay.next < replay.end) replaysPending--;
+    replay.next = 0;
+    replay.end = 0;
+
+    uint64_t start, end;
+    if (page == 0 || !history.Page(page, start, end)) return;
+    if (end - start > lines) start = end - lines;
+    replay.next = start;
+    replay.end = end;
+    replay.page = page;
+    replay.titled = false;
+    replaysPending++;
+}
+
+void ircRelay::Scrollback(int budget) {
+    std::shared_ptr<const IrcConfig> ircConfig = Config();
+
+    // irc users get their page at once, the outbound queue keeps them from flooding the server
+    RingQueue<HistoryRequest>::Cell* cell;
+    while ((cell = historyRequests.Acquire()) != nullptr) {
+        HistoryRequest request = cell->data;
+        historyRequests.Release(cell);
+        if (request.network >= ircConfig->networks.size()) continue;
+
+        std::vector<std::string> lines;
+        uint64_t start, end;
+        if (history.Capacity() == 0) lines.push_back("The history is turned off.");
+        else if (history.Pages() == 0) lines.push_back("Nothing has been relayed yet.");
+        else if (!history.Page(request.page, start, end)) lines.push_back("There are " + std::to_string(history.Pages()) + " pages of history.");
+        else {
+            lines.push_back("History page " + std::to_string(request.page) + " of " + std::to_string(history.Pages()) + ":");
+            for (uint64_t sequence = start; sequence < end; sequence++) {
+                const HistoryEntry* entry = history.At(sequence);
+                if (entry == nullptr) continue;
+
+                // lines from irc carry bzflag colours by now, which irc can not show
+                std::string remembered = Remembered(*entry);
+                std::string sanitized;
+                lines.push_back(IrcText::FromGame(remembered.c_str(), remembered.size(), sanitized) ? sanitized : remembered);
+            }
+        }
+
+        for (size_t i = 0; i < lines.size(); i++) {
+            RelayLine* line = Allocate();
+            if (line == nullptr) break;
+
+            LineWriter writer(line->text, IRC_TEXT_SIZE);
+            writer.Append("NOTICE ").Append(request.nick).Append(" :").Append(ircConfig->prefix).Append(lines[i]);
+            line->kind = OUTBOUND_COMMAND;
+            line->length = writer.Length();
+            line->name[0] = '\0';
+            if (!connections[request.network]->Enqueue(line, "", ircConfig->overflow)) Release(line);
+        }
+        Wake();
+    }
+
+    // players get a line each in turn, so a crowd joining at once does not hold up the game
+    bool progressed = true;
+    while (budget > 0 && replaysPending > 0 && progressed) {
+        progressed = false;
+        for (size_t i = 0; i < IRC_ROSTER_SIZE && budget > 0; i++) {
+            int playerID = (int)((replayCursor + i) % IRC_ROSTER_SIZE);
+            HistoryReplay& replay = replays[playerID];
+            if (replay.next >= replay.end) continue;
+            progressed = true;
+
+            if (!replay.titled) {
+                std::string title = "IRC history page " + std::to_string(replay.page) + " of " + std::to_string(history.Pages()) + ", use /irchistory <page> for more:";
+                bz_sendTextMessage(BZ_SERVER, playerID, title.c_str());
+                replay.titled = true;
+                budget--;
+                continue;
+            }
+
+            const HistoryEntry* entry = history.At(replay.next++);
+            if (entry != nullptr) {
+                bz_sendTextMessage(BZ_SERVER, playerID, Remembered(*entry).c_str());
+                budget--;
+            }
+            if (replay.next >= replay.end) replaysPending--;
+        }
+        replayCursor = (replayCursor + 1) % IRC_ROSTER_SIZE;
+    }
+}
+
+std::string ircRelay::Remembered(const HistoryEntry& entry) {
+    char stamp[16];
+    struct tm* local = localtime(&entry.time);
+    if (local == NULL || strftime(stamp, sizeof(stamp), "[%H:%M] ", local) == 0) stamp[0] = '\0';
+    return std::string(stamp) + (entry.source == HISTORY_IRC ? "(irc) " : "") + std::string(entry.text, entry.length);
+}
+
+void ircRelay::FormatChat(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player, const char* message, bool action) {
+    if (action) {
+        line.Append("\001ACTION ").Append(ircConfig.prefix).Append(player.name, player.nameLength).Append(" ").Append(message).Append("\001");
+    }
+    else {
+        line.Append(ircConfig.prefix).Append(player.name, player.nameLength).Append(": \017").Append(message);
+    }
+}
+
+void ircRelay::FormatTeam(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player, int target, const char* message) {
+    line.Append(ircConfig.prefix).Append(player.name, player.nameLength).Append("\017 to ").Append(GetTeamStyle(target).team).Append(": ").Append(message);
+}
+
+void ircRelay::FormatReport(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player, const char* message) {
+    line.Append(ircConfig.prefix).Append(player.name, player.nameLength).Append("\017 reported: ").Append(message);
+}
+
+void ircRelay::FormatJoin(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player) {
+    line.Append(ircConfig.prefix).Append(player.name, player.nameLength).Append("\017 joined as a ").Append(GetTeamStyle(player.team).name).Append(" from ").Append(player.ip);
+}
+
+void ircRelay::FormatPart(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player) {
+    line.Append(ircConfig.prefix).Append(player.name, player.nameLength).Append("\017 left the game");
+}
+
+bool ircRelay::Deliver(bz_eMessageType type, IrcSlice from, const char* separator, IrcSlice text) {
+    // the hub passes the message on to the other servers, unless it is meant for one of them only
+    if (hubRole == HUB_SERVER && !hub.Route(type, from, separator, text)) return true;
+
+    RingQueue<InboundLine>::Cell* cell = inbound.Claim();
+    if (cell == nullptr) {
+        metrics.inboundDropped++;
+        return false;
+    }
+
+    // write the message into the inbox, the game thread will send it
+    InboundLine& line = cell->data;
+    size_t separatorLength = strlen(separator);
+    size_t length = 0;
+    size_t part = from.length < IRC_LINE_SIZE - 1 ? from.length : IRC_LINE_SIZE - 1;
+    memcpy(line.text, from.data, part);
+    length += part;
+    part = separatorLength < IRC_LINE_SIZE - 1 - length ? separatorLength : IRC_LINE_SIZE - 1 - length;
+    memcpy(line.text + length, separator, part);
+    length += part;
+    part = text.length < IRC_LINE_SIZE - 1 - length ? text.length : IRC_LINE_SIZE - 1 - length;
+    memcpy(line.text + length, text.data, part);
+    length += part;
+    line.text[length] = '\0';
+    line.length = length;
+    line.type = type;
+    line.received = Now();
+    inbound.Commit(cell);
+    IrcMetrics::Peak(metrics.inboundPeak, inbound.Size());
+    return true;
+}
+
+void ircRelay::Dispatch(int budget) {
+    char batch[BZ_MESSAGE_SIZE];
+    size_t batchLength = 0;
+    double now = Now();
+
+    RingQueue<InboundLine>::Cell* cell;
+    while (budget > 0 && (cell = inbound.Acquire()) != nullptr) {
+        InboundLine& line = cell->data;
+        bz_debugMessage(4, line.text);
+        metrics.inboundDelivered++;
+        metrics.inboundLatency.Record(now - line.received);
+        history.Add(HISTORY_IRC, line.type == eActionMessage ? "* " : "", line.text, line.length);
+
+        // chat lines get batched together as long as they fit into a single message
+        if (line.type == eChatMessage && line.length + 3 < BZ_MESSAGE_SIZE) {
+            if (batchLength > 0 && batchLength + 3 + line.length >= BZ_MESSAGE_SIZE) {
+                bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, batch);
+                batchLength = 0;
+            }
+            if (batchLength == 0) budget--;
+            if (batchLength > 0) {
+                memcpy(batch + batchLength, " | ", 3);
+                batchLength += 3;
+            }
+            memcpy(batch + batchLength, line.text, line.length + 1);
+            batchLength += line.length;
+            inbound.Release(cell);
+            continue;
+        }
+
+        // everything else goes out on its own
+        if (batchLength > 0) {
+            bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, batch);
+            batchLength = 0;
+        }
+        bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, line.type, line.text);
+        inbound.Release(cell);
+        budget--;
+    }
+
+    if (batchLength > 0) {
+        bz_sendTextMessage(BZ_SERVER, BZ_ALLUSERS, batch);
+    }
+}
+
+static const char* gameEvents[] = { "bzdb", "chat", "join", "part", "report", "spawn", "score", "die", "capture", "match", "tick" };
+
+void ircRelay::Capture(CaptureKind kind, size_t network, int team, int target, const char* name, const char* text, size_t length) {
+    RingQueue<CaptureEntry>::Cell* cell = captureQueue.Claim();
+    if (cell == nullptr) {
+        metrics.captureDropped++;
+        return;
+    }
+
+    CaptureRecord& record = cell->data.record;
+    size_t nameLength = strlen(name) < BZ_CALLSIGN_SIZE ? strlen(name) : BZ_CALLSIGN_SIZE - 1;
+    if (length > IRC_TEXT_SIZE) length = IRC_TEXT_SIZE;
+    record.time = Now();
+    record.length = (uint32_t)length;
+    record.kind = (uint8_t)kind;
+    record.network = (uint8_t)network;
+    record.team = (int8_t)team;
+    record.target = (int8_t)target;
+    memset(record.name, 0, BZ_CALLSIGN_SIZE);
+    memcpy(record.name, name, nameLength);
+    memcpy(cell->data.text, text, length);
+    captureQueue.Commit(cell);
+
+    // the recorder looks for new records on its own, unless the queue is about to fill up
+    if (captureQueue.Size() > captureQueue.Capacity() / 2) captureSignal.notify_one();
+}
+
+void ircRelay::Replay(const IrcReplay& replay) {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    replaying = false;
+#else
+    std::string debugMessage;
+    int fd = open(replay.path.c_str(), O_RDONLY);
+    struct stat info;
+    void* map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(CaptureHeader)) {
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (fd >= 0) close(fd);
+    if (map == MAP_FAILED) {
+        debugMessage = "Replaying irc traffic skipped, because " + replay.path + " could not be mapped";
+        bz_debugMessage(1, debugMessage.c_str());
+        replaying = false;
+        return;
+    }
+
+    size_t size = info.st_size;
+    const char* data = (const char*)map;
+    const CaptureHeader* header = (const CaptureHeader*)data;
+    if (header->magic != IRC_CAPTURE_MAGIC || header->version != IRC_CAPTURE_VERSION) {
+        debugMessage = "Replaying irc traffic skipped, because " + replay.path + " is not a capture";
+        bz_debugMessage(1, debugMessage.c_str());
+        munmap(map, size);
+        replaying = false;
+        return;
+    }
+
+    // the captured traffic runs through the parser, the filter and the formatter, but nothing gets sent
+    std::shared_ptr<const IrcConfig> ircConfig = Config();
+    std::unique_ptr<IrcReader> reader(new IrcReader());
+    std::unique_ptr<IrcHistogram> parseTime(new IrcHistogram());
+    std::unique_ptr<IrcHistogram> filterTime(new IrcHistogram());
+    std::unique_ptr<IrcHistogram> formatTime(new IrcHistogram());
+    char text[IRC_TEXT_SIZE];
+    uint64_t records = 0;
+    uint64_t lines = 0;
+    uint64_t events = 0;
+    double first = 0;
+    double start = Now();
+
+    size_t offset = sizeof(CaptureHeader);
+    while (!fc && offset + sizeof(CaptureRecord) <= size) {
+        CaptureRecord record;
+        memcpy(&record, data + offset, sizeof(CaptureRecord));
+        if (record.length > IRC_TEXT_SIZE || offset + sizeof(CaptureRecord) + record.length > size) break;
+        const char* payload = data + offset + sizeof(CaptureRecord);
+        offset += sizeof(CaptureRecord) + record.length;
+
+        // at recorded speed every record waits for its moment, in short naps so an unload does not sit out a long gap
+        if (records++ == 0) first = record.time;
+        double delay = (record.time - first) - (Now() - start);
+        while (!replay.fast && !fc && delay > 0) {
+            Wait(0, delay < 0.05 ? (unsigned int)(delay * 1000) + 1 : 50);
+            delay = (record.time - first) - (Now() - start);
+        }
+        if (fc) break;
+
+        double begin = Now();
+        if (record.kind == CAPTURE_INBOUND) {
+            size_t available;
+            char* space = reader->Space(available);
+            size_t length = record.length + 2 <= available ? record.length : (available > 2 ? available - 2 : 0);
+            memcpy(space, payload, length);
+            memcpy(space + length, "\r\n", 2);
+            reader->Fill(length + 2);
+
+            IrcMessage message;
+            while (reader->Next(message)) {
+                double parsed = Now();
+                parseTime->Record(parsed - begin);
+                lines++;
+
+                if (message.command.Equals("PRIVMSG") && message.paramCount >= 2) {
+                    IrcSlice body = message.Text();
+                    std::string filtered;
+                    bool ignored = !ircConfig->ignores.Empty() && ircConfig->ignores.Matches(message.nick, message.user, message.host);
+                    if (!ignored && !ircConfig->filter->Empty()) ircConfig->filter->Apply(body.data, body.length, filtered);
+                    if (!ignored) IrcText::FromIrc(body.data, body.length, filtered);
+                    filterTime->Record(Now() - parsed);
+                }
+                begin = Now();
+            }
+        }
+        else if (record.kind != CAPTURE_OUTBOUND) {
+            std::string message(payload, record.length);
+            FilterAction action = FILTER_PASS;
+            if (record.kind != CAPTURE_JOIN && record.kind != CAPTURE_PART && !ircConfig->filter->Empty()) {
+                std::string filtered;
+                action = ircConfig->filter->Apply(message.c_str(), message.size(), filtered);
+                if (action != FILTER_PASS) message = filtered;
+            }
+            double filtered = Now();
+            filterTime->Record(filtered - begin);
+            events++;
+
+            if (action != FILTER_DROP) {
+                char callsign[BZ_CALLSIGN_SIZE];
+                memcpy(callsign, record.name, BZ_CALLSIGN_SIZE);
+                callsign[BZ_CALLSIGN_SIZE - 1] = '\0';
+                RosterEntry player;
+                player.Assign(callsign, record.team, record.kind == CAPTURE_JOIN ? message.c_str() : "");
+
+                LineWriter writer(text, IRC_TEXT_SIZE);
+                if (record.kind == CAPTURE_CHAT || record.kind == CAPTURE_ACTION) FormatChat(writer, *ircConfig, player, message.c_str(), record.kind == CAPTURE_ACTION);
+                else if (record.kind == CAPTURE_TEAM) FormatTeam(writer, *ircConfig, player, record.target, message.c_str());
+                else if (record.kind == CAPTURE_REPORT) FormatReport(writer, *ircConfig, player, message.c_str());
+                else if (record.kind == CAPTURE_JOIN) FormatJoin(writer, *ircConfig, player);
+                else if (record.kind == CAPTURE_PART) FormatPart(writer, *ircConfig, player);
+                formatTime->Record(Now() - filtered);
+            }
+        }
+    }
+    double elapsed = Now() - start;
+    munmap(map, size);
+
+    char line[256];
+    snprintf(line, sizeof(line), "Replayed %llu records of %s in %.1f ms, %llu irc lines and %llu game events",
+        (unsigned long long)records, replay.path.c_str(), elapsed * 1000.0, (unsigned long long)lines, (unsigned long long)events);
+    bz_debugMessage(1, line);
+    const IrcHistogram* histograms[] = { parseTime.get(), filterTime.get(), formatTime.get() };
+    const char* names[] = { "parsing", "filtering", "formatting" };
+    for (size_t i = 0; i < 3; i++) {
+        snprintf(line, sizeof(line), "Replay time spent %s: p50 %llu us, p99 %llu us, max %llu us, total %llu us", names[i],
+            (unsigned long long)histograms[i]->Percentile(50), (unsigned long long)histograms[i]->Percentile(99),
+            (unsigned long long)histograms[i]->Max(), (unsigned long long)histograms[i]->Sum());
+        bz_debugMessage(1, line);
+    }
+    replaying = false;
+#endif
+}
+
+void ircRelay::Report(std::vector<std::string>& lines) {
+    static const char* states[] = { "disconnected", "resolving", "connecting", "handshaking", "registering", "identifying", "connected" };
+    std::shared_ptr<const IrcConfig> ircConfig = Config();
+    char line[256];
+
+    for (size_t i = 0; i < ircConfig->networks.size(); i++) {
+        const IrcNetwork& network = ircConfig->networks[i];
+        snprintf(line, sizeof(line), "IRC network %s (%s:%d) is %s", network.name.c_str(), network.address.c_str(), network.port, states[connections[i]->State()]);
+        lines.push_back(line);
+    }
+
+    snprintf(line, sizeof(line), "Outbound: %llu lines queued, %llu sent, %llu dropped, %llu bytes, queue peak %llu",
+        (unsigned long long)metrics.outboundQueued, (unsigned long long)metrics.outboundSent, (unsigned long long)metrics.outboundDropped,
+        (unsigned long long)metrics.outboundBytes, (unsigned long long)metrics.outboundPeak);
+    lines.push_back(line);
+    snprintf(line, sizeof(line), "Inbound: %llu lines received, %llu delivered, %llu dropped, %llu bytes, queue peak %llu",
+        (unsigned long long)metrics.inboundReceived, (unsigned long long)metrics.inboundDelivered, (unsigned long long)metrics.inboundDropped,
+        (unsigned long long)metrics.inboundBytes, (unsigned long long)metrics.inboundPeak);
+    lines.push_back(line);
+    snprintf(line, sizeof(line), "Reconnects: %llu, lines spooled: %llu, tls handshakes: %llu, %llu of them resumed", (unsigned long long)metrics.reconnects,
+        (unsigned long long)metrics.outboundSpooled, (unsigned long long)metrics.tlsHandshakes, (unsigned long long)metrics.tlsResumed);
+    lines.push_back(line);
+    if (ircConfig->hub != "") {
+        static const char* roles[] = { "direct", "hub", "client" };
+        snprintf(line, sizeof(line), "Hub %s: this server is %s as %s", ircConfig->hub.c_str(), roles[hubRole], ircConfig->hubTag.c_str());
+        lines.push_back(line);
+    }
+    if (capturing || metrics.captureRecorded > 0) {
+        snprintf(line, sizeof(line), "Capture: %llu records written, %llu dropped", (unsigned long long)metrics.captureRecorded, (unsigned long long)metrics.captureDropped);
+        lines.push_back(line);
+    }
+
+    // latencies in milliseconds
+    const IrcHistogram* histograms[] = { &metrics.outboundLatency, &metrics.inboundLatency, &metrics.pingLatency };
+    const char* names[] = { "Outbound latency", "Inbound latency", "Ping round trip" };
+    for (size_t i = 0; i < 3; i++) {
+        const IrcHistogram& histogram = *histograms[i];
+        snprintf(line, sizeof(line), "%s: p50 %.1f ms, p99 %.1f ms, max %.1f ms over %llu samples", names[i],
+            histogram.Percentile(50) / 1000.0, histogram.Percentile(99) / 1000.0, histogram.Max() / 1000.0, (unsigned long long)histogram.Count());
+        lines.push_back(line);
+    }
+
+    // time the game thread spent in the relay, in microseconds
+    for (size_t i = 0; i < GAME_EVENT_COUNT; i++) {
+        const IrcHistogram& histogram = metrics.gameStall[i];
+        if (histogram.Count() == 0) continue;
+        snprintf(line, sizeof(line), "Game thread in %s events: p50 %llu us, p99 %llu us, max %llu us over %llu events", gameEvents[i],
+            (unsigned long long)histogram.Percentile(50), (unsigned long long)histogram.Percentile(99), (unsigned long long)histogram.Max(), (unsigned long long)histogram.Count());
+        lines.push_back(line);
+    }
+}
+
+bool ircRelay::Export(const std::string& path) {
+    std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (file == NULL) return false;
+
+    std::shared_ptr<const IrcConfig> ircConfig = Config();
+    for (size_t i = 0; i < ircConfig->networks.size(); i++) {
+        if (i == 0) fprintf(file, "# TYPE ircrelay_connected gauge\n");
+        fprintf(file, "ircrelay_connected{network=\"%s\"} %d\n", ircConfig->networks[i].name.c_str(), connections[i]->Connected() ? 1 : 0);
+    }
+
+    fprintf(file, "# TYPE ircrelay_lines_total counter\n");
+    fprintf(file, "ircrelay_lines_total{direction=\"outbound\",result=\"queued\"} %llu\n", (unsigned long long)metrics.outboundQueued);
+    fprintf(file, "ircrelay_lines_total{direction=\"outbound\",result=\"sent\"} %llu\n", (unsigned long long)metrics.outboundSent);
+    fprintf(file, "ircrelay_lines_total{direction=\"outbound\",result=\"dropped\"} %llu\n", (unsigned long long)metrics.outboundDropped);
+    fprintf(file, "ircrelay_lines_total{direction=\"inbound\",result=\"received\"} %llu\n", (unsigned long long)metrics.inboundReceived);
+    fprintf(file, "ircrelay_lines_total{direction=\"inbound\",result=\"delivered\"} %llu\n", (unsigned long long)metrics.inboundDelivered);
+    fprintf(file, "ircrelay_lines_total{direction=\"inbound\",result=\"dropped\"} %llu\n", (unsigned long long)metrics.inboundDropped);
+    fprintf(file, "ircrelay_lines_total{direction=\"outbound\",result=\"spooled\"} %llu\n", (unsigned long long)metrics.outboundSpooled);
+    fprintf(file, "# TYPE ircrelay_bytes_total counter\n");
+    fprintf(file, "ircrelay_bytes_total{direction=\"outbound\"} %llu\n", (unsigned long long)metrics.outboundBytes);
+    fprintf(file, "ircrelay_bytes_total{direction=\"inbound\"} %llu\n", (unsigned long long)metrics.inboundBytes);
+    fprintf(file, "# TYPE ircrelay_queue_peak gauge\n");
+    fprintf(file, "ircrelay_queue_peak{direction=\"outbound\"} %llu\n", (unsigned long long)metrics.outboundPeak);
+    fprintf(file, "ircrelay_queue_peak{direction=\"inbound\"} %llu\n", (unsigned long long)metrics.inboundPeak);
+    fprintf(file, "# TYPE ircrelay_reconnects_total counter\n");
+    fprintf(file, "ircrelay_reconnects_total %llu\n", (unsigned long long)metrics.reconnects);
+    fprintf(file, "# TYPE ircrelay_tls_handshakes_total counter\n");
+    fprintf(file, "ircrelay_tls_handshakes_total{session=\"new\"} %llu\n", (unsigned long long)(metrics.tlsHandshakes - metrics.tlsResumed));
+    fprintf(file, "ircrelay_tls_handshakes_total{session=\"resumed\"} %llu\n", (unsigned long long)metrics.tlsResumed);
+    fprintf(file, "# TYPE ircrelay_capture_records_total counter\n");
+    fprintf(file, "ircrelay_capture_records_total{result=\"written\"} %llu\n", (unsigned long long)metrics.captureRecorded);
+    fprintf(file, "ircrelay_capture_records_total{result=\"dropped\"} %llu\n", (unsigned long long)metrics.captureDropped);
+
+    // the bucket limits are powers of two, from a microsecond up to about a minute
+    auto histogram = [file](const char* name, const std::string& labels, const IrcHistogram& histogram) {
+        std::string separator = labels == "" ? "" : ",";
+        for (int bit = 0; bit <= 26; bit++) {
+            uint64_t limit = (uint64_t)1 << bit;
+            fprintf(file, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels.c_str(), separator.c_str(), limit / 1000000.0, (unsigned long long)histogram.UpTo(limit));
+        }
+        fprintf(file, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels.c_str(), separator.c_str(), (unsigned long long)histogram.Count());
+        std::string braces = labels == "" ? "" : "{" + labels + "}";
+        fprintf(file, "%s_sum%s %g\n", name, braces.c_str(), histogram.Sum() / 1000000.0);
+        fprintf(file, "%s_count%s %llu\n", name, braces.c_str(), (unsigned long long)histogram.Count());
+    };
+    fprintf(file, "# TYPE ircrelay_outbound_latency_seconds histogram\n");
+    histogram("ircrelay_outbound_latency_seconds", "", metrics.outboundLatency);
+    fprintf(file, "# TYPE ircrelay_inbound_latency_seconds histogram\n");
+    histogram("ircrelay_inbound_latency_seconds", "", metrics.inboundLatency);
+    fprintf(file, "# TYPE ircrelay_ping_seconds histogram\n");
+    histogram("ircrelay_ping_seconds", "", metrics.pingLatency);
+    fprintf(file, "# TYPE ircrelay_game_stall_seconds histogram\n");
+    for (size_t i = 0; i < GAME_EVENT_COUNT; i++) {
+        histogram("ircrelay_game_stall_seconds", std::string("event=\"") + gameEvents[i] + "\"", metrics.gameStall[i]);
+    }
+
+    // replace the previous dump at once, so a scraper never sees half of it
+    if (fclose(file) != 0) return false;
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    remove(path.c_str());
+#endif
+    return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+double ircRelay::Now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void ircRelay::Worker() {
+    bz_debugMessage(2, "Worker for irc server connection started");
+    double statsTime = 0;
+
+    while (!fc) {
+        double now = Now();
+
+        // dump the metrics for scraping
+        std::shared_ptr<const IrcConfig> ircConfig = Config();
+        if (ircConfig->statsFile != "" && now >= statsTime) {
+            if (!Export(ircConfig->statsFile)) bz_debugMessage(2, "Writing the irc relay metrics failed");
+            statsTime = now + ircConfig->statsInterval;
+        }
+
+        // hand finished lookups to their connections
+        RingQueue<IrcResolve>::Cell* resolved;
+        while ((resolved = resolveResults.Acquire()) != nullptr) {
+            connections[resolved->data.index]->Resolved(resolved->data);
+            resolveResults.Release(resolved);
+        }
+
+        // relay the game events that are due, before the connections send them
+        double digestDue = Aggregate(now);
+
+        // find out who owns the connections, before they get started
+        hub.Update(now);
+
+        // connect, time out and send queued messages
+        for (size_t i = 0; i < IRC_NETWORK_SIZE; i++) connections[i]->Update(now);
+
+        // wait until a socket or the wake pipe has something for us, or the next timeout is due
+        struct pollfd pfds[IRC_NETWORK_SIZE * IRC_ADDRESS_SIZE + IRC_HUB_SIZE + 3];
+        size_t offsets[IRC_NETWORK_SIZE + 1];
+        int count = 0;
+        double due = now + 1;
+        if (ircConfig->statsFile != "" && statsTime < due) due = statsTime;
+        if (digestDue < due) due = digestDue;
+        for (size_t i = 0; i < IRC_NETWORK_SIZE; i++) {
+            double connectionDue = connections[i]->Due(now);
+            if (connectionDue < due) due = connectionDue;
+            offsets[i] = count;
+            count += connections[i]->Poll(pfds + count);
+        }
+        offsets[IRC_NETWORK_SIZE] = count;
+        double hubDue = hub.Due(now);
+        if (hubDue < due) due = hubDue;
+        size_t hubCount = hub.Poll(pfds + count);
+        count += hubCount;
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+        int timeout = 50;
+#else
+        pfds[count].fd = wakeFds[0];
+        pfds[count].events = POLLIN;
+        pfds[count].revents = 0;
+        count++;
+        int timeout = 1000;
+#endif
+        if (due - now < timeout / 1000.0) timeout = due > now ? (int)((due - now) * 1000) + 1 : 0;
+        if (poll(pfds, count, timeout) < 0 && !Pending()) {
+            bz_debugMessage(1, "Waiting for the irc server connection failed");
+            Wait(0, 100);
+            continue;
+        }
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+        // reset the wake pipe
+        if (pfds[count - 1].revents & POLLIN) {
+            char signals[64];
+            woken = false;
+            while (read(wakeFds[0], signals, sizeof(signals)) > 0) {}
+        }
+#endif
+
+        // receive and send on every connection that is ready
+        for (size_t i = 0; i < IRC_NETWORK_SIZE; i++) {
+            connections[i]->Process(pfds + offsets[i], offsets[i + 1] - offsets[i]);
+        }
+        hub.Process(pfds + offsets[IRC_NETWORK_SIZE], hubCount);
+    }
+
+    // close the connections on shutdown, the other servers take over the hub
+    for (size_t i = 0; i < IRC_NETWORK_SIZE; i++) connections[i]->Shutdown();
+    hub.Close();
+#if defined(IRCRELAY_TLS)
+    if (tlsContext != nullptr) SSL_CTX_free(tlsContext);
+    tlsContext = nullptr;
+#endif
+
+    bz_debugMessage(2, "Worker for irc server connection stopped");
+}
+
+void ircRelay::Resolver() {
+    bz_debugMessage(2, "Resolver for irc server addresses started");
+
+    // the channel reads the resolver configuration of the system once
+    ares_channel channel;
+    if (ares_init(&channel) != ARES_SUCCESS) {
+        bz_debugMessage(1, "Resolver for irc server addresses could not be initialized");
+        return;
+    }
+
+    while (!fc) {
+        RingQueue<IrcResolve>::Cell* request = resolveRequests.Acquire();
+        if (request == nullptr) {
+            std::unique_lock<std::mutex> lock(resolveMutex);
+            resolveSignal.wait_for(lock, std::chrono::seconds(1), []() { return fc || resolveRequests.Size() > 0; });
+            continue;
+        }
+        IrcResolve resolve = request->data;
+        resolveRequests.Release(request);
+
+        // the lookup may take a while, but it gets cancelled as soon as the plugin stops
+        Query(channel, resolve);
+        if (fc) break;
+
+        RingQueue<IrcResolve>::Cell* result = resolveResults.Claim();
+        if (result == nullptr) continue;
+        result->data = resolve;
+        resolveResults.Commit(result);
+        Wake();
+    }
+
+    ares_destroy(channel);
+    bz_debugMessage(2, "Resolver for irc server addresses stopped");
+}
+
+void ircRelay::Recorder() {
+    bz_debugMessage(2, "Recorder for irc traffic started");
+    FILE* file = NULL;
+    std::string path;
+
+    while (!fc) {
+        // follow the configured capture file, an existing one gets appended to
+        std::shared_ptr<const IrcConfig> ircConfig = Config();
+        if (ircConfig->capture != path) {
+            capturing = false;
+            if (file != NULL) fclose(file);
+            path = ircConfig->capture;
+            file = path == "" ? NULL : fopen(path.c_str(), "ab");
+            if (file != NULL) {
+                fseek(file, 0, SEEK_END);
+                if (ftell(file) == 0) {
+                    CaptureHeader header = { IRC_CAPTURE_MAGIC, IRC_CAPTURE_VERSION };
+                    fwrite(&header, sizeof(header), 1, file);
+                }
+                capturing = true;
+                std::string debugMessage = "Capturing irc traffic to " + path;
+                bz_debugMessage(2, debugMessage.c_str());
+            }
+            else if (path != "") {
+                std::string debugMessage = "Capturing irc traffic skipped, because " + path + " could not be opened";
+                bz_debugMessage(1, debugMessage.c_str());
+            }
+        }
+
+        RingQueue<CaptureEntry>::Cell* cell = captureQueue.Acquire();
+        if (cell == nullptr) {
+            if (file != NULL) fflush(file);
+            std::unique_lock<std::mutex> lock(captureMutex);
+            captureSignal.wait_for(lock, std::chrono::milliseconds(100), []() { return fc || captureQueue.Size() > captureQueue.Capacity() / 2; });
+            continue;
+        }
+
+        // records that were queued while the file changed end up in the new one
+        if (file != NULL) {
+            fwrite(&cell->data.record, sizeof(CaptureRecord), 1, file);
+            fwrite(cell->data.text, 1, cell->data.record.length, file);
+            metrics.captureRecorded++;
+        }
+        captureQueue.Release(cell);
+    }
+
+    capturing = false;
+    if (file != NULL) fclose(file);
+    bz_debugMessage(2, "Recorder for irc traffic stopped");
+}
+
+void ircRelay::Wait(unsigned int seconds, unsigned int milliseconds) {
+#if defined(WIN32) || defined(_WIN32) || defined(WIN64) || defined(_WIN64)
+    Sleep((seconds * 1000) + milliseconds);
+#else
+    if (seconds > 0) sleep(seconds);
+    if (milliseconds > 0) usleep(milliseconds * 1000);
+#endif
 }
@@ -5,27 +5,1076 @@
 #include "bzfsAPI.h"
 #include "plugin_utils.h"
 
-#include <regex>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
-int fd;
-bool fc;
-unsigned int pingCount;
-unsigned int retryCount;
-std::regex rgx("[0-9]{1,3}\\.[0-9]{1,3}\\.[0-9]{1,3}\\.[0-9]{1,3}");
+#include <ares.h>
 
-class ircRelay : public bz_Plugin {
+#if defined(IRCRELAY_TLS)
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#endif
+
+#define IRC_LINE_SIZE 512
+#define IRC_TEXT_SIZE 1024
+#define IRC_PAYLOAD_SIZE 400
+#define IRC_QUEUE_SIZE 256
+#define IRC_POOL_SIZE 1024
+#define IRC_NETWORK_SIZE 4
+#define IRC_CHANNEL_SIZE 64
+#define IRC_HOST_SIZE 256
+#define IRC_ADDRESS_SIZE 8
+#define IRC_HUB_SIZE 16
+#define IRC_COALESCE_SIZE 16
+#define IRC_BUFFER_SIZE 8192
+#define IRC_PARAMS_SIZE 15
+#define IRC_HISTOGRAM_SIZE 256
+#define IRC_ROSTER_SIZE 256
+#define IRC_IP_SIZE 48
+#define IRC_HISTORY_SIZE 1024
+#define IRC_HISTORY_PAGE 10
+#define IRC_HISTORY_BUDGET 8
+#define IRC_SPOOL_MAGIC 0x4952434C
+#define IRC_SPOOL_SKIPPED 0xFFFFFFFF
+#define IRC_CAPTURE_MAGIC 0x49524343
+#define IRC_CAPTURE_VERSION 1
+#define BZ_MESSAGE_SIZE 128
+#define BZ_CALLSIGN_SIZE 32
+
+#define IRC_RESOLVE_TIMEOUT 30
+#define IRC_RESOLVE_TTL 300
+#define IRC_CONNECT_TIMEOUT 10
+#define IRC_CONNECT_DELAY 0.25
+#define IRC_PING_INTERVAL 60
+#define IRC_QUERY_INTERVAL 10
+#define IRC_HUB_RETRY 1
+#define IRC_REGISTER_TIMEOUT 30
+#define IRC_IDENTIFY_TIMEOUT 1
+
+// bounded lock-free queue, cells are claimed and released in place so no copy or allocation is needed
+template <typename T>
+class RingQueue {
+    public:
+        struct Cell {
+            std::atomic<size_t> sequence;
+            size_t position;
+            T data;
+        };
+
+        RingQueue(size_t capacity) {
+            size_t size = 2;
+            while (size < capacity) size = size * 2;
+
+            mask = size - 1;
+            cells = new Cell[size];
+            for (size_t i = 0; i < size; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+            head.store(0, std::memory_order_relaxed);
+            tail.store(0, std::memory_order_relaxed);
+        }
+
+        ~RingQueue() {
+            delete[] cells;
+        }
+
+        // reserves a cell for writing, returns nullptr when the queue is full
+        Cell* Claim() {
+            size_t position = tail.load(std::memory_order_relaxed);
+            while (true) {
+                Cell* cell = &cells[position & mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        cell->position = position;
+                        return cell;
+                    }
+                }
+                else if (diff < 0) return nullptr;
+                else position = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        // publishes a claimed cell to the consumer
+        void Commit(Cell* cell) {
+            cell->sequence.store(cell->position + 1, std::memory_order_release);
+        }
+
+        // takes the oldest cell for reading, returns nullptr when the queue is empty
+        Cell* Acquire() {
+            size_t position = head.load(std::memory_order_relaxed);
+            while (true) {
+                Cell* cell = &cells[position & mask];
+                size_t sequence = cell->sequence.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)sequence - (intptr_t)(position + 1);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                        cell->position = position;
+                        return cell;
+                    }
+                }
+                else if (diff < 0) return nullptr;
+                else position = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        // hands an acquired cell back to the producer
+        void Release(Cell* cell) {
+            cell->sequence.store(cell->position + mask + 1, std::memory_order_release);
+        }
+
+        size_t Size() const {
+            size_t first = head.load(std::memory_order_relaxed);
+            size_t last = tail.load(std::memory_order_relaxed);
+            return last > first ? last - first : 0;
+        }
+
+        size_t Capacity() const {
+            return mask + 1;
+        }
+
+    private:
+        // head and tail are kept on separate cache lines, so producer and consumer do not slow each other down
+        Cell* cells;
+        size_t mask;
+        char headPadding[64];
+        std::atomic<size_t> head;
+        char tailPadding[64];
+        std::atomic<size_t> tail;
+};
+
+// a piece of a received line, only valid until the reader gets filled again
+struct IrcSlice {
+    const char* data;
+    size_t length;
+
+    bool Equals(const char* text) const {
+        size_t size = strlen(text);
+        return length == size && memcmp(data, text, size) == 0;
+    }
+
+    bool StartsWith(const char* text) const {
+        size_t size = strlen(text);
+        return length >= size && memcmp(data, text, size) == 0;
+    }
+
+    IrcSlice Substr(size_t offset, size_t count) const {
+        IrcSlice slice;
+        slice.data = data + (offset < length ? offset : length);
+        slice.length = offset < length ? (count < length - offset ? count : length - offset) : 0;
+        return slice;
+    }
+};
+
+// a tokenized irc line as described by RFC 1459 and the IRCv3 message tags
+struct IrcMessage {
+    IrcSlice line;
+    IrcSlice tags;
+    IrcSlice prefix;
+    IrcSlice nick;
+    IrcSlice user;
+    IrcSlice host;
+    IrcSlice command;
+    IrcSlice params[IRC_PARAMS_SIZE];
+    size_t paramCount;
+    bool trailing;
+
+    // the last parameter, which usually carries the message text
+    IrcSlice Text() const {
+        if (paramCount > 0) return params[paramCount - 1];
+        IrcSlice empty = { line.data, 0 };
+        return empty;
+    }
+};
+
+// keeps received data across reads and tokenizes complete lines in place
+class IrcReader {
+    public:
+        IrcReader();
+
+        char* Space(size_t& available);
+        void Fill(size_t length);
+        bool Next(IrcMessage& message);
+        void Reset();
+
+    private:
+        char buffer[IRC_BUFFER_SIZE];
+        size_t start;
+        size_t end;
+        bool overflow;
+};
+
+// writes into a fixed buffer and cuts off whatever does not fit
+class LineWriter {
+    public:
+        LineWriter(char* buffer, size_t capacity) : buffer(buffer), capacity(capacity), length(0) {}
+
+        LineWriter& Append(const char* text, size_t size) {
+            if (size > capacity - length) size = capacity - length;
+            memcpy(buffer + length, text, size);
+            length += size;
+            return *this;
+        }
+
+        LineWriter& Append(const char* text) {
+            return Append(text, strlen(text));
+        }
+
+        LineWriter& Append(const std::string& text) {
+            return Append(text.c_str(), text.size());
+        }
+
+        size_t Length() const {
+            return length;
+        }
+
+    private:
+        char* buffer;
+        size_t capacity;
+        size_t length;
+};
+
+// latency histogram in microseconds, every power of two is split into four buckets, recording never locks
+class IrcHistogram {
+    public:
+        IrcHistogram();
+
+        void Record(double seconds);
+        uint64_t Percentile(double percentile) const;
+        uint64_t UpTo(uint64_t value) const;
+        uint64_t Count() const { return count.load(std::memory_order_relaxed); }
+        uint64_t Sum() const { return sum.load(std::memory_order_relaxed); }
+        uint64_t Max() const { return max.load(std::memory_order_relaxed); }
+
+    private:
+        static size_t Bucket(uint64_t value);
+        static uint64_t Limit(size_t bucket);
+
+        std::atomic<uint64_t> buckets[IRC_HISTOGRAM_SIZE];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+};
+
+// the events that hold up the game thread while the relay handles them
+enum GameEvent {
+    GAME_BZDB,
+    GAME_CHAT,
+    GAME_JOIN,
+    GAME_PART,
+    GAME_REPORT,
+    GAME_SPAWN,
+    GAME_SCORE,
+    GAME_DIE,
+    GAME_CAPTURE,
+    GAME_MATCH,
+    GAME_TICK,
+    GAME_EVENT_COUNT
+};
+
+// counters of the relay, written by the game thread and the worker without locking
+struct IrcMetrics {
+    std::atomic<uint64_t> outboundQueued;
+    std::atomic<uint64_t> outboundSent;
+    std::atomic<uint64_t> outboundDropped;
+    std::atomic<uint64_t> outboundBytes;
+    std::atomic<uint64_t> outboundPeak;
+    std::atomic<uint64_t> outboundSpooled;
+    std::atomic<uint64_t> inboundReceived;
+    std::atomic<uint64_t> inboundDelivered;
+    std::atomic<uint64_t> inboundDropped;
+    std::atomic<uint64_t> inboundBytes;
+    std::atomic<uint64_t> inboundPeak;
+    std::atomic<uint64_t> reconnects;
+    std::atomic<uint64_t> tlsHandshakes;
+    std::atomic<uint64_t> tlsResumed;
+    std::atomic<uint64_t> captureRecorded;
+    std::atomic<uint64_t> captureDropped;
+    IrcHistogram outboundLatency;
+    IrcHistogram inboundLatency;
+    IrcHistogram pingLatency;
+    IrcHistogram gameStall[GAME_EVENT_COUNT];
+
+    // remembers the highest queue depth seen so far
+    static void Peak(std::atomic<uint64_t>& peak, uint64_t depth) {
+        uint64_t current = peak.load(std::memory_order_relaxed);
+        while (depth > current && !peak.compare_exchange_weak(current, depth, std::memory_order_relaxed)) {}
+    }
+};
+
+enum FilterAction {
+    FILTER_PASS,
+    FILTER_MASK,
+    FILTER_REWRITE,
+    FILTER_DROP
+};
+
+// an Aho-Corasick automaton over all filter patterns, so matching costs the same no matter how many there are
+class IrcFilter {
+    public:
+        IrcFilter();
+
+        void Add(const std::string& pattern, FilterAction action, const std::string& replacement);
+        void Compile();
+        bool Empty() const { return patterns.size() == 0; }
+        size_t Size() const { return patterns.size(); }
+
+        // returns the strongest action of all matches, masked or rewritten text only gets written when something matched
+        FilterAction Apply(const char* text, size_t length, std::string& output) const;
+
+    private:
+        struct Pattern {
+            size_t length;
+            bool wordStart;
+            bool wordEnd;
+            FilterAction action;
+            std::string replacement;
+        };
+
+        struct Node {
+            std::vector<std::pair<unsigned char, int> > next;
+            int fail;
+            int pattern;
+            int output;
+        };
+
+        int Child(int node, unsigned char c) const;
+
+        std::vector<Pattern> patterns;
+        std::vector<Node> nodes;
+        int root[256];
+};
+
+// turns the formatting of irc into bzflag colours and strips what is not safe in either direction
+class IrcText {
+    public:
+        static size_t Scan(const char* text, size_t length);
+        static bool FromIrc(const char* text, size_t length, std::string& translated);
+        static bool FromGame(const char* text, size_t length, std::string& translated);
+
+        // the loops behind Scan, each one stops at the first block with a special byte, the vector ones only exist on x86
+        static size_t ScanScalar(const char* text, size_t length, size_t start);
+        static size_t ScanSse2(const char* text, size_t length, size_t start);
+        static size_t ScanAvx2(const char* text, size_t length, size_t start);
+
+    private:
+        static size_t Utf8Length(const unsigned char* text, size_t length);
+};
+
+// ignored irc users, plain nicks and full masks are looked up, only masks with wildcards need to be tried one by one
+struct IrcIgnore {
+    std::unordered_set<std::string> nicks;
+    std::unordered_set<std::string> masks;
+    std::vector<std::string> wildcards;
+
+    void Add(const std::string& entry);
+    bool Empty() const { return nicks.size() == 0 && masks.size() == 0 && wildcards.size() == 0; }
+    bool Matches(IrcSlice nick, IrcSlice user, IrcSlice host) const;
+};
+
+// mIRC colour code and description of every team, indexed by bz_eTeamType
+struct TeamStyle {
+    const char* color;
+    const char* name;
+    const char* team;
+};
+
+constexpr TeamStyle teamStyles[] = {
+    { "\00307", "rogue", "rogues" },                 // eRogueTeam
+    { "\00304", "red player", "red team" },          // eRedTeam
+    { "\00303", "green player", "green team" },      // eGreenTeam
+    { "\00302", "blue player", "blue team" },        // eBlueTeam
+    { "\00306", "purple player", "purple team" },    // ePurpleTeam
+    { "\00314", "rabbit", "rabbit" },                // eRabbitTeam
+    { "\00307", "hunter", "hunters" },               // eHunterTeam
+    { "\00310", "observer", "observers" },           // eObservers
+    { "\017", "administrator", "admins" }            // eAdministrators
+};
+
+constexpr TeamStyle teamStyleNone = { "\017", "", "" };
+
+constexpr const TeamStyle& GetTeamStyle(int team) {
+    return team >= 0 && team < (int)(sizeof(teamStyles) / sizeof(teamStyles[0])) ? teamStyles[team] : teamStyleNone;
+}
+
+// a player as the relay knows it, indexed by player id and only touched by the game thread
+struct RosterEntry {
+    bool active;
+    int team;
+    char callsign[BZ_CALLSIGN_SIZE];
+    char ip[IRC_IP_SIZE];
+    char name[BZ_CALLSIGN_SIZE + 4]; // the callsign in its team colour
+    size_t nameLength;
+    int wins;
+    int losses;
+    int teamKills;
+
+    void Assign(const char* playerCallsign, int playerTeam, const char* playerIp);
+    void Recolor(int playerTeam);
+};
+
+enum DigestKind {
+    DIGEST_KILL,
+    DIGEST_CAPTURE,
+    DIGEST_START,
+    DIGEST_END
+};
+
+// a game event as the game thread hands it over, the worker folds the kills into summaries
+struct DigestEvent {
+    DigestKind kind;
+    int team;
+    int target;
+    double duration;
+    char name[BZ_CALLSIGN_SIZE];
+};
+
+struct DigestScore {
+    std::string callsign;
+    int team;
+    unsigned int kills;
+};
+
+// the kills of the current window, only touched by the worker
+struct IrcDigest {
+    double windowStart;
+    unsigned int kills;
+    std::vector<DigestScore> killers;
+};
+
+// the questions irc users can ask with !players, !score and !status
+enum QueryKind {
+    QUERY_PLAYERS,
+    QUERY_SCORE,
+    QUERY_STATUS,
+    QUERY_COUNT
+};
+
+struct SnapshotPlayer {
+    char callsign[BZ_CALLSIGN_SIZE];
+    int team;
+    int wins;
+    int losses;
+    int teamKills;
+};
+
+// the game state as the worker gets to see it, published by the game thread and never changed afterwards
+struct IrcSnapshot {
+    uint64_t version;
+    double published;
+    double uptime;
+    int gameType;
+    std::string description;
+    std::vector<SnapshotPlayer> players;
+    int teamWins[ePurpleTeam + 1];
+    int teamLosses[ePurpleTeam + 1];
+};
+
+// the formatted answers to the current snapshot, only touched by the worker
+struct IrcQueryCache {
+    uint64_t version;
+    std::vector<std::string> answers[QUERY_COUNT];
+};
+
+enum HistorySource {
+    HISTORY_GAME,
+    HISTORY_IRC
+};
+
+// a relayed line as the players got to see it
+struct HistoryEntry {
+    time_t time;
+    uint8_t source;
+    uint16_t length;
+    char text[IRC_LINE_SIZE];
+};
+
+// the last relayed lines in both directions, allocated once and only touched by the game thread
+class IrcHistory {
+    public:
+        IrcHistory() : next(0) {}
+
+        void Resize(size_t capacity);
+        void Add(HistorySource source, const char* prefix, const char* text, size_t length);
+        bool Page(size_t page, uint64_t& start, uint64_t& end) const;
+        size_t Pages() const { return (size_t)((next - First() + IRC_HISTORY_PAGE - 1) / IRC_HISTORY_PAGE); }
+        size_t Capacity() const { return entries.size(); }
+        uint64_t First() const { return next > entries.size() ? next - entries.size() : 0; }
+        uint64_t Next() const { return next; }
+
+        // entries that got overwritten in the meantime are gone
+        const HistoryEntry* At(uint64_t sequence) const {
+            return sequence >= First() && sequence < next ? &entries[sequence % entries.size()] : nullptr;
+        }
+
+    private:
+        std::vector<HistoryEntry> entries;
+        uint64_t next;
+};
+
+// the part of the history a player still waits for, sent a few lines per tick
+struct HistoryReplay {
+    uint64_t next;
+    uint64_t end;
+    size_t page;
+    bool titled;
+};
+
+// an irc user asking for a page of the history, answered by the game thread
+struct HistoryRequest {
+    size_t network;
+    size_t page;
+    char nick[IRC_CHANNEL_SIZE];
+};
+
+enum OutboundKind {
+    OUTBOUND_COMMAND,
+    OUTBOUND_CHAT,
+    OUTBOUND_JOIN,
+    OUTBOUND_PART
+};
+
+enum RelayEvent {
+    RELAY_CHAT,
+    RELAY_TEAM,
+    RELAY_ADMIN,
+    RELAY_JOIN,
+    RELAY_PART,
+    RELAY_IRC,
+    RELAY_GAME
+};
+
+// a formatted line shared by all routes it goes to, returned to the pool when the last one is done with it
+struct RelayLine {
+    std::atomic<int> references;
+    double created;
+    OutboundKind kind;
+    size_t length;
+    char name[BZ_CALLSIGN_SIZE];
+    char text[IRC_TEXT_SIZE];
+};
+
+struct OutboundEntry {
+    RelayLine* line;
+    char channel[IRC_CHANNEL_SIZE];
+};
+
+// the lines a channel missed while the queue was full, summarized once it drained
+struct CoalescedRoute {
+    char channel[IRC_CHANNEL_SIZE];
+    unsigned int count;
+};
+
+struct OutboundLine {
+    double created;
+    OutboundKind kind;
+    size_t length;
+    char name[BZ_CALLSIGN_SIZE];
+    char text[IRC_TEXT_SIZE];
+};
+
+// the file layout of the spool, a header followed by a ring of fixed size records
+struct SpoolHeader {
+    uint32_t magic;
+    uint32_t recordSize;
+    uint64_t capacity;
+    uint64_t head;
+    uint64_t tail;
+    char reserved[32];
+};
+
+struct SpoolRecord {
+    int64_t created;
+    uint32_t kind;
+    uint32_t length;
+    char name[BZ_CALLSIGN_SIZE];
+    char channel[IRC_CHANNEL_SIZE];
+    char text[IRC_TEXT_SIZE];
+};
+
+enum CaptureKind {
+    CAPTURE_INBOUND,
+    CAPTURE_OUTBOUND,
+    CAPTURE_CHAT,
+    CAPTURE_ACTION,
+    CAPTURE_TEAM,
+    CAPTURE_REPORT,
+    CAPTURE_JOIN,
+    CAPTURE_PART
+};
+
+// the file layout of a capture, a header followed by records, each one followed by its text
+struct CaptureHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// irc lines keep their network, game events the player and the teams involved
+struct CaptureRecord {
+    double time;
+    uint32_t length;
+    uint8_t kind;
+    uint8_t network;
+    int8_t team;
+    int8_t target;
+    char name[BZ_CALLSIGN_SIZE];
+};
+
+struct CaptureEntry {
+    CaptureRecord record;
+    char text[IRC_TEXT_SIZE];
+};
+
+struct IrcReplay {
+    std::string path;
+    bool fast;
+};
+
+// a memory mapped file that keeps outbound lines across outages and restarts, only used by the worker
+class IrcSpool {
+    public:
+        IrcSpool();
+        ~IrcSpool();
+
+        bool Open(const std::string& path, size_t capacity);
+        void Close();
+        bool Matches(const std::string& path, size_t capacity) const { return this->path == path && this->capacity == capacity; }
+        bool IsOpen() const { return header != nullptr; }
+        size_t Size() const { return header != nullptr ? (size_t)(header->tail - header->head) : 0; }
+
+        void Append(const RelayLine& line, const char* channel);
+        bool Pop(OutboundLine& line, int maxAge);
+
+    private:
+        bool Collapse(const SpoolRecord& join);
+
+        std::string path;
+        size_t capacity;
+        int fd;
+        size_t mapped;
+        SpoolHeader* header;
+        SpoolRecord* records;
+};
+
+struct InboundLine {
+    double received;
+    bz_eMessageType type;
+    size_t length;
+    char text[IRC_LINE_SIZE];
+};
+
+enum IrcState {
+    IRC_DISCONNECTED,
+    IRC_RESOLVING,
+    IRC_CONNECTING,
+    IRC_HANDSHAKING,
+    IRC_REGISTERING,
+    IRC_IDENTIFYING,
+    IRC_CONNECTED
+};
+
+// moves the bytes of a connection, plain or encrypted, without ever blocking
+class IrcTransport {
+    public:
+        virtual ~IrcTransport() {}
+
+        // returns 1 once the connection is ready, 0 while it needs another round trip and -1 when it failed
+        virtual int Handshake() { return 1; }
+
+        // return the number of bytes moved, 0 when the socket would block and -1 when the connection is gone
+        virtual int Read(char* buffer, size_t length) = 0;
+        virtual int Write(const char* buffer, size_t length) = 0;
+
+        virtual bool WantsWrite() const { return false; }
+        virtual bool Resumed() const { return false; }
+        virtual void Close() {}
+};
+
+class PlainTransport : public IrcTransport {
+    public:
+        PlainTransport(int fd) : fd(fd) {}
+
+        virtual int Read(char* buffer, size_t length);
+        virtual int Write(const char* buffer, size_t length);
+
+    private:
+        int fd;
+};
+
+#if defined(IRCRELAY_TLS)
+// non-blocking tls on top of the connected socket, new sessions are kept by the connection for resumption
+class TlsTransport : public IrcTransport {
+    public:
+        TlsTransport(int fd, const std::string& host, bool verify, SSL_SESSION** session);
+        virtual ~TlsTransport();
+
+        virtual int Handshake();
+        virtual int Read(char* buffer, size_t length);
+        virtual int Write(const char* buffer, size_t length);
+
+        virtual bool WantsWrite() const { return wantsWrite; }
+        virtual bool Resumed() const { return ssl != nullptr && SSL_session_reused(ssl) == 1; }
+        virtual void Close();
+
+        static int NewSession(SSL* ssl, SSL_SESSION* session);
+
+    private:
+        bool Retry(int result);
+
+        SSL* ssl;
+        SSL_SESSION** session;
+        bool wantsWrite;
+};
+#endif
+
+// a resolved socket address, big enough for IPv4 and IPv6
+struct IrcEndpoint {
+    int family;
+    size_t length;
+    char address[128];
+};
+
+// a lookup handed to the resolver thread and back, the endpoints alternate between the address families
+struct IrcResolve {
+    size_t index;
+    unsigned int generation;
+    char host[IRC_HOST_SIZE];
+    int port;
+    size_t count;
+    IrcEndpoint endpoints[IRC_ADDRESS_SIZE];
+};
+
+// a lookup of the resolver thread while c-ares works on it
+struct IrcLookup {
+    IrcResolve* resolve;
+    bool done;
+};
+
+enum OverflowPolicy {
+    OVERFLOW_OLDEST,
+    OVERFLOW_NEWEST,
+    OVERFLOW_COALESCE
+};
+
+struct IrcRoute {
+    RelayEvent event;
+    size_t network;
+    std::string channel;
+};
+
+struct IrcNetwork {
+    std::string name;
+    std::string address;
+    int port;
+    bool tls;
+    std::string pass;
+    std::string authType;
+    std::string authPass;
+    std::vector<std::string> channels;
+    std::vector<std::string> relayed;
+};
+
+// an immutable copy of the BZDB settings, rebuilt whenever one of them changes
+struct IrcConfig {
+    std::string nick;
+    std::string prefix;
+    std::vector<IrcNetwork> networks;
+    std::vector<IrcRoute> routes;
+    unsigned int routed;
+    IrcIgnore ignores;
+    std::shared_ptr<const IrcFilter> filter;
+    std::string filterSource;
+    OverflowPolicy overflow;
+    int tickBudget;
+    int burst;
+    double rate;
+    bool tlsVerify;
+    std::string statsFile;
+    int statsInterval;
+    std::string spool;
+    int spoolSize;
+    int spoolAge;
+    std::string capture;
+    unsigned int digest;
+    int digestWindow;
+    std::string hub;
+    std::string hubTag;
+    size_t history;
+    size_t historyJoin;
+};
+
+// a single irc server connection with its own socket, state and send queue, driven by the worker
+class IrcConnection {
+    public:
+        IrcConnection(size_t index);
+
+        bool Enqueue(RelayLine* line, const std::string& channel, OverflowPolicy policy);
+        bool Connected() const { return state == IRC_CONNECTED; }
+        int State() const { return state; }
+        bool Accepting() const { return state == IRC_CONNECTED || spooling; }
+        void Reconfigure();
+
+        void Update(double now);
+        double Due(double now);
+        size_t Poll(struct pollfd* pfds);
+        void Process(struct pollfd* pfds, size_t count);
+        void Resolved(const IrcResolve& resolve);
+        void Shutdown();
+
+    private:
+        void Start();
+        void Apply(double now);
+        void Connect(double now);
+        bool Attempt(double now);
+        short Complete(struct pollfd* pfds, size_t count);
+        bool Secure();
+        void Login();
+        void Identify();
+        void Join();
+        void Stop();
+
+        bool Receive();
+        void Handle(IrcMessage& message);
+        bool Query(IrcSlice nick, IrcSlice text);
+        char* Reserve(size_t length);
+        void Commit(size_t length, int debugLevel);
+        void Send(const char* data, size_t length, int debugLevel);
+        void Send(const std::string& data, int debugLevel);
+        bool Write();
+
+        void Drain();
+        void Spill(bool commands);
+        bool Next(OutboundLine& line);
+        void Summarize(OutboundLine& line);
+        void Coalesce(const std::string& channel);
+        int Split(const char* text, size_t length);
+
+        size_t index;
+        int fd;
+        std::atomic<int> state;
+        std::atomic<bool> reconfigure;
+        double deadline;
+        double nextAttempt;
+        unsigned int pingCount;
+        unsigned int retryCount;
+        std::minstd_rand jitter;
+        unsigned int connectCount;
+        std::string nick;
+        bool negotiating;
+        bool saslOffered;
+        double pingTime;
+        double pingSent;
+        std::shared_ptr<const IrcConfig> active;
+
+        // when each irc user got the last answer to a query
+        std::unordered_map<std::string, double> queried;
+
+        // resolved addresses are kept until their time to live is over
+        IrcEndpoint endpoints[IRC_ADDRESS_SIZE];
+        size_t endpointCount;
+        size_t endpointNext;
+        std::string endpointHost;
+        int endpointPort;
+        double endpointExpires;
+        unsigned int resolveGeneration;
+
+        // pending connects, the first one to succeed becomes the connection
+        int attempts[IRC_ADDRESS_SIZE];
+        size_t attemptCount;
+        double attemptTime;
+
+        // plain or tls, set up once the socket is connected
+        std::unique_ptr<IrcTransport> transport;
+        double handshakeTime;
+#if defined(IRCRELAY_TLS)
+        SSL_SESSION* tlsSession;
+#endif
+
+        IrcReader reader;
+        char writeBuffer[IRC_BUFFER_SIZE];
+        size_t writeLength;
+
+        RingQueue<OutboundEntry> outbound;
+        IrcSpool spool;
+        std::atomic<bool> spooling;
+        std::atomic<unsigned int> coalesced;
+        std::mutex coalesceMutex;
+        CoalescedRoute coalescedRoutes[IRC_COALESCE_SIZE];
+        double tokens;
+        double tokensTime;
+        OutboundLine current;
+        OutboundLine held;
+        bool holding;
+};
+
+enum HubRole {
+    HUB_DIRECT,
+    HUB_SERVER,
+    HUB_CLIENT
+};
+
+enum HubFrameType {
+    HUB_HELLO,
+    HUB_LINE,
+    HUB_CHAT
+};
+
+// the framing between the hub and its clients, a header followed by the name and the text
+struct HubFrame {
+    uint16_t length;
+    uint8_t type;
+    uint8_t event;      // the RelayEvent of a line, the bz_eMessageType of a chat
+    uint8_t kind;       // the OutboundKind of a line
+    uint8_t nameLength; // the tag of a hello, the callsign of a line
+    uint16_t reserved;
+};
+
+// a line of the game thread waiting to be passed on to the hub
+struct HubEntry {
+    RelayLine* line;
+    RelayEvent event;
+};
+
+// a bzfs on the other end of the hub socket
+struct HubPeer {
+    int fd;
+    std::string tag;
+    size_t readLength;
+    size_t writeLength;
+    char readBuffer[IRC_BUFFER_SIZE];
+    char writeBuffer[IRC_BUFFER_SIZE];
+};
+
+// shares the irc connections of one bzfs with the others on the same host, only used by the worker
+class IrcHub {
+    public:
+        IrcHub();
+
+        void Update(double now);
+        double Due(double now) const;
+        size_t Poll(struct pollfd* pfds);
+        void Process(struct pollfd* pfds, size_t count);
+        bool Route(bz_eMessageType type, IrcSlice from, const char* separator, IrcSlice& text);
+        void Close();
+
+    private:
+        bool Elect();
+        bool Join();
+        void Accept();
+        void Forward();
+        void Drop(HubPeer& peer);
+        bool Read(HubPeer& peer);
+        bool Write(HubPeer& peer);
+        bool Frame(HubPeer& peer, HubFrameType type, uint8_t event, uint8_t kind, const char* name, size_t nameLength, const char* text, size_t length);
+        void Handle(HubPeer& peer, const HubFrame& frame, const char* name, const char* text);
+
+        std::string path;
+        std::string tag;
+        int lockFd;
+        int listenFd;
+        bool disabled;
+        double nextAttempt;
+        HubPeer upstream;
+        std::vector<std::unique_ptr<HubPeer> > peers;
+};
+
+std::atomic<bool> fc;
+std::shared_ptr<const IrcConfig> config;
+std::atomic<bool> woken;
+int wakeFds[2];
+
+RingQueue<IrcResolve> resolveRequests(IRC_NETWORK_SIZE * 2);
+RingQueue<IrcResolve> resolveResults(IRC_NETWORK_SIZE * 2);
+std::mutex resolveMutex;
+std::condition_variable resolveSignal;
+
+IrcConnection* connections[IRC_NETWORK_SIZE];
+#if defined(IRCRELAY_TLS)
+SSL_CTX* tlsContext;
+#endif
+RelayLine relayLines[IRC_POOL_SIZE];
+RingQueue<RelayLine*> relayPool(IRC_POOL_SIZE);
+RingQueue<InboundLine> inbound(IRC_QUEUE_SIZE);
+IrcMetrics metrics;
+RingQueue<CaptureEntry> captureQueue(IRC_QUEUE_SIZE * 4);
+std::atomic<bool> capturing;
+std::atomic<bool> replaying;
+std::mutex captureMutex;
+std::condition_variable captureSignal;
+RosterEntry roster[IRC_ROSTER_SIZE];
+bool rosterChanged;
+std::shared_ptr<const IrcSnapshot> snapshot;
+IrcQueryCache queryCache;
+RingQueue<DigestEvent> digestQueue(IRC_QUEUE_SIZE * 4);
+IrcDigest digest;
+std::atomic<int> hubRole;
+RingQueue<HubEntry> hubQueue(IRC_QUEUE_SIZE);
+IrcHub hub;
+IrcHistory history;
+HistoryReplay replays[IRC_ROSTER_SIZE];
+size_t replaysPending;
+size_t replayCursor;
+RingQueue<HistoryRequest> historyRequests(IRC_NETWORK_SIZE * 8);
+
+class ircRelay : public bz_Plugin, public bz_CustomSlashCommandHandler {
     public:
         virtual const char* Name();
         virtual void Init(const char* config);
         virtual void Cleanup();
         virtual void Event(bz_EventData* eventData);
+        virtual bool SlashCommand(int playerID, bz_ApiString command, bz_ApiString message, bz_APIStringList* params);
+        void HandleEvent(bz_EventData* eventData);
+
+        static void Configure(const char* key, const char* value);
+        static std::shared_ptr<const IrcConfig> Config();
+        static void Wake();
+        static bool Pending();
+        static bool Resolve(const IrcResolve& resolve);
+        static bool Lookup(IrcResolve& resolve);
+        static bool Query(ares_channel channel, IrcResolve& resolve);
+        static void Answered(void* arg, int status, int timeouts, struct ares_addrinfo* result);
+
+        static RelayLine* Allocate();
+        static void Release(RelayLine* line);
+        static void Relay(const IrcConfig& ircConfig, RelayEvent event, RelayLine* line, OutboundKind kind, const char* name, size_t length);
+        static void Queue(std::string data);
+        static std::string Base64(const std::string& data);
 
-        static void Start();
-        static void Stop();
+        static RosterEntry* Player(int playerID);
+        static void Enter(int playerID, bz_BasePlayerRecord* record);
+        static void Publish();
+        static void Collect(DigestKind kind, const RosterEntry* player, int target, double duration);
+        static double Aggregate(double now);
+        static bool Answer(QueryKind kind, std::vector<std::string>& lines);
+        static void Recall(int playerID, size_t page, size_t lines);
+        static void Scrollback(int budget);
+        static std::string Remembered(const HistoryEntry& entry);
+        static void FormatChat(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player, const char* message, bool action);
+        static void FormatTeam(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player, int target, const char* message);
+        static void FormatReport(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player, const char* message);
+        static void FormatJoin(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player);
+        static void FormatPart(LineWriter& line, const IrcConfig& ircConfig, const RosterEntry& player);
+        static bool Deliver(bz_eMessageType type, IrcSlice from, const char* separator, IrcSlice text);
+        static void Dispatch(int budget);
 
-        static void Receive(const char* until);
-        static void Send(std::string data, int debugLevel);
+        static void Report(std::vector<std::string>& lines);
+        static bool Export(const std::string& path);
+        static void Capture(CaptureKind kind, size_t network, int team, int target, const char* name, const char* text, size_t length);
+        static void Replay(const IrcReplay& replay);
 
+        static double Now();
         static void Wait(unsigned int seconds, unsigned int milliseconds);
         static void Worker();
+        static void Resolver();
+        static void Recorder();
 };
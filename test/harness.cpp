@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2024 Dirk Sarodnick
+ * All rights reserved.
+ */
+
+// drives the relay like bzfs would, against the local irc server in test/mockircd.py, and reports what it costs
+#include "../ircRelay.cpp"
+
+#include <string>
+#include <thread>
+
+struct HarnessOptions {
+    int port = 0;
+    double seconds = 5;
+    double drain = 10;
+    double chatRate = 50;
+    double joinRate = 10;
+    double inboundRate = 50;
+    double tickRate = 100;
+    std::string rate = "1000";
+    std::string burst = "100";
+    std::string overflow = "oldest";
+    double minAcked = 0;
+    double minDelivered = 0;
+    bool tls = false;
+    bool expectReconnect = false;
+    bool expectResumed = false;
+};
+
+// what reached the game from irc, filled by the message handler of the stub on the game thread
+struct HarnessResults {
+    bool ready = false;
+    bool done = false;
+    uint64_t acked = 0;
+    uint64_t talked = 0;
+    uint64_t talkSent = 0;
+    uint64_t received = 0;
+    IrcHistogram outbound;
+    IrcHistogram inbound;
+};
+
+static HarnessResults results;
+
+static void Received(int from, int to, const char* message) {
+    double now = ircRelay::Now();
+    if (strstr(message, "ready") != NULL) results.ready = true;
+
+    // the mock server counts every relayed line it read, the reports can only grow
+    const char* received = strstr(message, "received lines=");
+    if (received != NULL) {
+        uint64_t lines = strtoull(received + 15, NULL, 10);
+        if (lines > results.received) results.received = lines;
+    }
+
+    // batched lines are separated by " | ", every stamp counts on its own
+    const char* cursor = message;
+    while ((cursor = strstr(cursor, "stamp=")) != NULL) {
+        double stamp = atof(cursor + 6);
+        const char* recv = strstr(cursor, "recv=");
+        const char* next = strstr(cursor + 6, "stamp=");
+        if (recv != NULL && (next == NULL || recv < next)) {
+            double arrived = atof(recv + 5);
+            results.outbound.Record(arrived - stamp);
+            results.inbound.Record(now - arrived);
+            results.acked++;
+        }
+        else {
+            results.inbound.Record(now - stamp);
+            results.talked++;
+        }
+        cursor += 6;
+    }
+
+    const char* done = strstr(message, "done count=");
+    if (done != NULL) {
+        results.talkSent = strtoull(done + 11, NULL, 10);
+        results.done = true;
+    }
+}
+
+static bool Parse(int argc, char** argv, HarnessOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--expect-reconnect") {
+            options.expectReconnect = true;
+            continue;
+        }
+        if (option == "--expect-resumed") {
+            options.expectResumed = true;
+            continue;
+        }
+        if (option == "--tls") {
+            options.tls = true;
+            continue;
+        }
+        if (i + 1 >= argc) return false;
+        const char* value = argv[++i];
+        if (option == "--port") options.port = atoi(value);
+        else if (option == "--seconds") options.seconds = atof(value);
+        else if (option == "--drain") options.drain = atof(value);
+        else if (option == "--chat") options.chatRate = atof(value);
+        else if (option == "--join") options.joinRate = atof(value);
+        else if (option == "--inbound") options.inboundRate = atof(value);
+        else if (option == "--tick") options.tickRate = atof(value);
+        else if (option == "--rate") options.rate = value;
+        else if (option == "--burst") options.burst = value;
+        else if (option == "--overflow") options.overflow = value;
+        else if (option == "--min-acked") options.minAcked = atof(value);
+        else if (option == "--min-delivered") options.minDelivered = atof(value);
+        else return false;
+    }
+    return options.port > 0 && options.tickRate > 0 && options.seconds > 0;
+}
+
+static void Report(const char* name, const IrcHistogram& histogram, double scale) {
+    if (histogram.Count() == 0) {
+        printf("  %-12s %10s %10s %10s %8d\n", name, "-", "-", "-", 0);
+        return;
+    }
+    printf("  %-12s %10.1f %10.1f %10.1f %8llu\n", name, histogram.Percentile(50) / scale, histogram.Percentile(99) / scale, histogram.Max() / scale, (unsigned long long)histogram.Count());
+}
+
+int main(int argc, char** argv) {
+    HarnessOptions options;
+    if (!Parse(argc, argv, options)) {
+        fprintf(stderr, "usage: %s --port <port> [--seconds 5] [--drain 10] [--chat 50] [--join 10] [--inbound 50] [--tick 100] [--rate 1000] [--burst 100] [--overflow oldest] [--min-acked 0] [--min-delivered 0] [--tls] [--expect-reconnect] [--expect-resumed]\n", argv[0]);
+        return 2;
+    }
+#if !defined(IRCRELAY_TLS)
+    if (options.tls) {
+        printf("TLS is not built in, the run is skipped\n");
+        return 77;
+    }
+#endif
+
+    // one network, one channel, sending as fast as the options allow
+    std::string port = std::to_string(options.port);
+    bz_stubSetBZDB("_ircAddress", "127.0.0.1");
+    bz_stubSetBZDB("_ircPort", port.c_str());
+    bz_stubSetBZDB("_ircChannel", "harness");
+    bz_stubSetBZDB("_ircNick", "relay");
+    bz_stubSetBZDB("_ircRate", options.rate.c_str());
+    bz_stubSetBZDB("_ircBurst", options.burst.c_str());
+    bz_stubSetBZDB("_ircOverflow", options.overflow.c_str());
+
+    // the mock server has a self-signed certificate, so only the handshake and the resumption get tested
+    if (options.tls) {
+        bz_stubSetBZDB("_ircTls", "1");
+        bz_stubSetBZDB("_ircTlsVerify", "0");
+    }
+    bz_stubSetMessageHandler(Received);
+
+    ircRelay plugin;
+    plugin.Init("");
+    double tickInterval = 1 / options.tickRate;
+    bz_TickEventData_V1 tick;
+    auto advance = [&](double until) {
+        plugin.Event(&tick);
+        double now = ircRelay::Now();
+        if (until > now) std::this_thread::sleep_for(std::chrono::duration<double>(until - now));
+    };
+
+    // the talker who chats, joining like any player
+    bz_BasePlayerRecord talker;
+    talker.playerID = 0;
+    talker.callsign = "talker";
+    talker.ipAddress = "127.0.0.1";
+    talker.team = eRedTeam;
+    talker.wins = 0;
+    talker.losses = 0;
+    talker.teamKills = 0;
+    bz_stubAddPlayer(talker.playerID, talker.callsign.c_str(), talker.team);
+    bz_PlayerJoinPartEventData_V1 talkerJoin(bz_ePlayerJoinEvent);
+    talkerJoin.playerID = talker.playerID;
+    talkerJoin.record = &talker;
+    plugin.Event(&talkerJoin);
+
+    double start = ircRelay::Now();
+    while (!results.ready && ircRelay::Now() - start < 10) advance(ircRelay::Now() + tickInterval);
+    if (!results.ready) {
+        fprintf(stderr, "The relay never joined the channel of the mock server on port %d\n", options.port);
+        plugin.Cleanup();
+        return 1;
+    }
+
+    // the mock server starts talking once it sees this line
+    char storm[128];
+    snprintf(storm, sizeof(storm), "storm rate=%g seconds=%g", options.inboundRate, options.seconds);
+    bz_ChatEventData_V2 chat;
+    chat.from = talker.playerID;
+    chat.message = storm;
+    if (options.inboundRate > 0) plugin.Event(&chat);
+    else results.done = true;
+
+    // players come and go in their own slots, every second event of a slot is a part
+    const int slots = 64;
+    bool joined[slots] = {};
+    bz_BasePlayerRecord records[slots];
+    for (int i = 0; i < slots; i++) {
+        records[i].playerID = i + 1;
+        records[i].callsign = "storm" + std::to_string(i + 1);
+        records[i].ipAddress = "127.0.0.1";
+        records[i].team = i % 2 == 0 ? eGreenTeam : eBlueTeam;
+        records[i].wins = 0;
+        records[i].losses = 0;
+        records[i].teamKills = 0;
+    }
+
+    uint64_t chats = 0;
+    uint64_t joinParts = 0;
+    uint64_t sentBefore = metrics.outboundSent;
+    uint64_t deliveredBefore = metrics.inboundDelivered;
+    start = ircRelay::Now();
+    double next = start;
+    char text[64];
+    while (ircRelay::Now() - start < options.seconds) {
+        double elapsed = ircRelay::Now() - start;
+        for (uint64_t due = (uint64_t)(elapsed * options.chatRate); chats < due; chats++) {
+            snprintf(text, sizeof(text), "load seq=%llu stamp=%.6f", (unsigned long long)chats, ircRelay::Now());
+            chat.message = text;
+            plugin.Event(&chat);
+        }
+        for (uint64_t due = (uint64_t)(elapsed * options.joinRate); joinParts < due; joinParts++) {
+            int slot = (int)(joinParts / 2 % slots);
+            bz_PlayerJoinPartEventData_V1 event(joined[slot] ? bz_ePlayerPartEvent : bz_ePlayerJoinEvent);
+            event.playerID = records[slot].playerID;
+            event.record = &records[slot];
+            if (joined[slot]) bz_stubRemovePlayer(event.playerID);
+            else bz_stubAddPlayer(event.playerID, records[slot].callsign.c_str(), records[slot].team);
+            plugin.Event(&event);
+            joined[slot] = !joined[slot];
+        }
+        next += tickInterval;
+        advance(next);
+    }
+    double stormEnd = ircRelay::Now();
+
+    // every line handed to the relay has to end up at the mock server or in a counter of the relay,
+    // which are the joins and parts, the chat lines, the join of the talker and the line that starts the storm
+    uint64_t offered = chats + joinParts + 1 + (options.inboundRate > 0 ? 1 : 0);
+    auto accounted = [&]() { return results.received + metrics.outboundDropped + metrics.outboundSpooled; };
+
+    // keep ticking until every line is accounted for and the storm came back, or the drain time is over
+    while ((accounted() < offered || !results.done || results.talked < results.talkSent) && ircRelay::Now() - stormEnd < options.drain) {
+        next += tickInterval;
+        advance(next);
+    }
+    double elapsed = ircRelay::Now() - start;
+    uint64_t sent = metrics.outboundSent - sentBefore;
+    uint64_t delivered = metrics.inboundDelivered - deliveredBefore;
+    uint64_t dropped = metrics.outboundDropped;
+    uint64_t spooled = metrics.outboundSpooled;
+    uint64_t reconnects = metrics.reconnects;
+    uint64_t handshakes = metrics.tlsHandshakes;
+    uint64_t resumed = metrics.tlsResumed;
+    plugin.Cleanup();
+
+    printf("storm of %g s: %g chat/s, %g join and part/s, %g irc lines/s, %g ticks/s\n\n", options.seconds, options.chatRate, options.joinRate, options.inboundRate, options.tickRate);
+    printf("game thread stall (us)       p50        p99        max   events\n");
+    Report("chat", metrics.gameStall[GAME_CHAT], 1);
+    Report("join", metrics.gameStall[GAME_JOIN], 1);
+    Report("part", metrics.gameStall[GAME_PART], 1);
+    Report("tick", metrics.gameStall[GAME_TICK], 1);
+    printf("\nend to end latency (ms)      p50        p99        max    lines\n");
+    Report("game to irc", results.outbound, 1000);
+    Report("irc to game", results.inbound, 1000);
+    printf("\nthroughput over %.1f s\n", elapsed);
+    printf("  game to irc  %8.1f lines/s, %llu of %llu chat lines acknowledged, %llu dropped, %llu spooled\n", sent / elapsed, (unsigned long long)results.acked, (unsigned long long)chats, (unsigned long long)dropped, (unsigned long long)spooled);
+    if (results.done) printf("  irc to game  %8.1f lines/s, %llu of %llu storm lines delivered, %llu dropped\n", delivered / elapsed, (unsigned long long)results.talked, (unsigned long long)results.talkSent, (unsigned long long)metrics.inboundDropped.load());
+    else printf("  irc to game  %8.1f lines/s, %llu storm lines delivered before the storm got cut off, %llu dropped\n", delivered / elapsed, (unsigned long long)results.talked, (unsigned long long)metrics.inboundDropped.load());
+    printf("  accounted    %llu of %llu offered lines, %llu read by the mock server, %llu dropped, %llu spooled\n", (unsigned long long)(results.received + dropped + spooled),
+        (unsigned long long)offered, (unsigned long long)results.received, (unsigned long long)dropped, (unsigned long long)spooled);
+    printf("  reconnects   %llu\n", (unsigned long long)reconnects);
+    if (options.tls) printf("  tls          %llu handshakes, %llu resumed\n", (unsigned long long)handshakes, (unsigned long long)resumed);
+
+    // no spool is configured, so a spooled line is never sent again and every line is counted once
+    int status = 0;
+    if (results.received + dropped + spooled != offered) {
+        fprintf(stderr, "%llu lines were offered, but %llu were read by the mock server, dropped or spooled\n", (unsigned long long)offered, (unsigned long long)(results.received + dropped + spooled));
+        status = 1;
+    }
+    if (chats > 0 && results.acked < options.minAcked * chats) {
+        fprintf(stderr, "Only %llu of %llu chat lines were acknowledged, at least %g were expected\n", (unsigned long long)results.acked, (unsigned long long)chats, options.minAcked * chats);
+        status = 1;
+    }
+    if (options.inboundRate > 0 && (!results.done || results.talked < options.minDelivered * results.talkSent || results.talked == 0)) {
+        fprintf(stderr, "Only %llu of %llu storm lines reached the game, at least %g were expected\n", (unsigned long long)results.talked, (unsigned long long)results.talkSent, options.minDelivered * results.talkSent);
+        status = 1;
+    }
+    if (options.expectReconnect && reconnects == 0) {
+        fprintf(stderr, "The relay was expected to get disconnected and reconnect\n");
+        status = 1;
+    }
+    if (options.expectResumed && (handshakes < 2 || resumed == 0)) {
+        fprintf(stderr, "The relay was expected to resume its tls session on the next handshake\n");
+        status = 1;
+    }
+    return status;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Copyright (C) 2024 Dirk Sarodnick
+# All rights reserved.
+#
+# runs the harness against the mock irc server in test/mockircd.py, once for every scenario, used by make check
+
+srcdir=${srcdir:-.}
+harness=${HARNESS:-./test/harness}
+status=0
+
+# without python there is no mock server, automake counts the test as skipped
+command -v python3 > /dev/null || exit 77
+
+run() {
+    name=$1
+    server=$2
+    shift 2
+    portfile=harness-$$.port
+    rm -f "$portfile"
+    python3 "$srcdir/test/mockircd.py" --port-file "$portfile" $server &
+    pid=$!
+    tries=0
+    while [ ! -s "$portfile" ] && [ $tries -lt 50 ]; do
+        sleep 0.1
+        tries=$((tries + 1))
+    done
+
+    echo "== $name"
+    if [ ! -s "$portfile" ]; then
+        echo "The mock server did not start"
+        status=1
+    else
+        "$harness" --port "$(cat "$portfile")" "$@"
+        result=$?
+        if [ $result -ne 0 ] && [ $result -ne 77 ]; then
+            status=1
+        fi
+    fi
+    kill $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    rm -f "$portfile"
+    echo
+}
+
+# every scenario has to account for each line it offered, the floors are loose and only catch a relay that stalls
+run "steady traffic" "" --chat 50 --join 10 --inbound 50 --min-acked 0.95 --min-delivered 0.95
+run "chat, join and part storm" "" --chat 500 --join 200 --inbound 500 --min-acked 0.9 --min-delivered 0.9
+run "excess flood disconnect" "--flood 50 --flood-limit 1" --chat 100 --join 0 --inbound 0 --rate 40 --burst 100 --min-acked 0.05 --expect-reconnect
+run "slow reader back-pressure" "--slow 16384" --chat 300 --join 50 --inbound 50 --overflow coalesce --min-acked 0.5 --min-delivered 0.9
+
+# the certificate of the mock server is made with the openssl command, the flood makes the relay reconnect once and resume
+if command -v openssl > /dev/null; then
+    run "tls session resumption" "--tls --flood 50 --flood-limit 1" --tls --chat 100 --join 0 --inbound 0 --rate 40 --burst 100 --min-acked 0.05 --expect-reconnect --expect-resumed
+else
+    echo "== tls session resumption skipped, there is no openssl command"
+fi
+
+exit $status
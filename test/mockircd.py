@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2024 Dirk Sarodnick
+# All rights reserved.
+#
+# a local irc server for the harness, it can misbehave like real networks do:
+#   --ping SECONDS   pings the relay and closes the link when no pong comes back within --ping-timeout
+#   --flood LINES    closes the link with an excess flood error when more lines arrive within a second, and reads on until the relay hangs up,
+#                    --flood-limit COUNT only does so for the first COUNT links
+#   --slow BYTES     reads only that many bytes per second, so the relay runs into back-pressure
+#   --tls            speaks tls with a self-signed certificate made by the openssl command, resuming sessions from tickets
+#
+# every line relayed from the game with a stamp= gets acknowledged in the channel with the time it arrived,
+# and a relayed "storm rate=R seconds=S" makes the server talk into the channel at that rate.
+# the server counts every relayed line it read, a summary of joins or parts as the lines it stands for,
+# and reports the total with "received lines=N" four times a second, so the harness can account for every line
+
+import argparse
+import os
+import re
+import shutil
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+STAMP = re.compile(rb"stamp=([0-9.]+)")
+STORM = re.compile(rb"storm rate=([0-9.]+) seconds=([0-9.]+)")
+SUMMARY = re.compile(rb" :(\d+) players (?:joined|left): ")
+COALESCED = re.compile(rb" :\d+ messages were not relayed$")
+
+
+class Tally:
+    # shared by the connections, so lines read before a disconnect still count after the reconnect
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.lines = 0
+        self.floods = 0
+
+    def count(self, line):
+        words = line.split(b" ", 2)
+        if len(words) < 3 or words[0].upper() != b"PRIVMSG" or not words[1].startswith(b"#"):
+            return
+        if COALESCED.search(line):
+            return
+        summary = SUMMARY.search(line)
+        with self.lock:
+            self.lines += int(summary.group(1)) if summary else 1
+
+
+class Client:
+    def __init__(self, options, tally, connection):
+        self.options = options
+        self.tally = tally
+        self.connection = connection
+        self.lock = threading.Lock()
+        self.open = True
+        self.nick = b"relay"
+        self.channels = []
+        self.pong = time.monotonic()
+        self.arrivals = []
+        self.flooded = False
+
+    def send(self, line):
+        with self.lock:
+            if not self.open:
+                return
+            try:
+                self.connection.sendall(line + b"\r\n")
+            except OSError:
+                self.open = False
+
+    def close(self, reason):
+        self.send(b"ERROR :Closing Link: " + reason)
+        with self.lock:
+            self.open = False
+        try:
+            self.connection.shutdown(socket.SHUT_RDWR)
+        except OSError:
+            pass
+
+    def read(self):
+        # a slow reader takes small bites, the rest waits in the socket buffers
+        size = 512 if self.options.slow > 0 else 65536
+        data = self.connection.recv(size)
+        if self.options.slow > 0 and data:
+            time.sleep(len(data) / self.options.slow)
+        return data
+
+    def flooding(self, now):
+        if self.options.flood <= 0:
+            return False
+        self.arrivals.append(now)
+        while self.arrivals and self.arrivals[0] < now - 1:
+            self.arrivals.pop(0)
+        if len(self.arrivals) <= self.options.flood:
+            return False
+        with self.tally.lock:
+            if self.options.flood_limit > 0 and self.tally.floods >= self.options.flood_limit:
+                return False
+            self.tally.floods += 1
+        return True
+
+    def reporter(self):
+        while self.open:
+            time.sleep(0.25)
+            with self.tally.lock:
+                lines = self.tally.lines
+            for channel in list(self.channels):
+                self.send(b":mock!mock@mockircd PRIVMSG #" + channel + b" :received lines=%d" % lines)
+
+    def pinger(self):
+        while self.open:
+            time.sleep(self.options.ping)
+            if time.monotonic() - self.pong > self.options.ping_timeout:
+                self.close(b"(Ping timeout)")
+                return
+            self.send(b"PING :mockircd")
+
+    def storm(self, channel, rate, seconds):
+        # the stamps use the monotonic clock, which the relay and the harness read as well
+        start = time.monotonic()
+        count = 0
+        while self.open and time.monotonic() - start < seconds:
+            due = int((time.monotonic() - start) * rate)
+            while count < due:
+                count += 1
+                self.send(b":talker!talker@mockircd PRIVMSG #" + channel + b" :talk seq=%d stamp=%.6f" % (count, time.monotonic()))
+            time.sleep(0.002)
+        self.send(b":talker!talker@mockircd PRIVMSG #" + channel + b" :done count=%d" % count)
+
+    def handle(self, line):
+        words = line.split(b" ")
+        command = words[0].upper()
+        if command == b"NICK" and len(words) > 1:
+            self.nick = words[1]
+        elif command == b"USER":
+            self.send(b":mockircd 001 " + self.nick + b" :Welcome to the mock network")
+            self.send(b":mockircd 376 " + self.nick + b" :End of MOTD")
+        elif command == b"CAP" and len(words) > 1:
+            # no sasl on offer, so a relay set up for it has to go on without
+            if words[1].upper() == b"LS":
+                self.send(b":mockircd CAP * LS :multi-prefix")
+            elif words[1].upper() == b"REQ":
+                self.send(b":mockircd CAP * NAK " + b" ".join(words[2:]))
+        elif command == b"PING":
+            self.send(b":mockircd PONG mockircd :" + line.split(b":", 1)[-1])
+        elif command == b"PONG":
+            self.pong = time.monotonic()
+        elif command == b"JOIN" and len(words) > 1:
+            for channel in words[1].split(b","):
+                channel = channel.lstrip(b"#")
+                self.channels.append(channel)
+                self.send(b":" + self.nick + b"!relay@mockircd JOIN #" + channel)
+                self.send(b":mock!mock@mockircd PRIVMSG #" + channel + b" :ready")
+        elif command == b"PRIVMSG" and len(words) > 2:
+            channel = words[1].lstrip(b"#")
+            storm = STORM.search(line)
+            if storm:
+                threading.Thread(target=self.storm, args=(channel, float(storm.group(1)), float(storm.group(2))), daemon=True).start()
+                return
+            for stamp in STAMP.findall(line):
+                self.send(b":mock!mock@mockircd PRIVMSG #" + channel + b" :ack stamp=" + stamp + b" recv=%.6f" % time.monotonic())
+        elif command == b"QUIT":
+            self.close(b"(Quit)")
+
+    def run(self):
+        if isinstance(self.connection, ssl.SSLSocket):
+            try:
+                self.connection.do_handshake()
+            except (OSError, ssl.SSLError):
+                self.connection.close()
+                return
+        if self.options.ping > 0:
+            threading.Thread(target=self.pinger, daemon=True).start()
+        threading.Thread(target=self.reporter, daemon=True).start()
+
+        # after an excess flood the link is only closed for writing, what the relay had sent already is read and counted
+        pending = b""
+        while True:
+            try:
+                data = self.read()
+            except OSError:
+                break
+            if not data:
+                break
+            pending += data
+            while b"\n" in pending:
+                line, pending = pending.split(b"\n", 1)
+                line = line.rstrip(b"\r")
+                if not line:
+                    continue
+                self.tally.count(line)
+                if self.flooded:
+                    continue
+                if self.flooding(time.monotonic()):
+                    self.flooded = True
+                    self.send(b"ERROR :Closing Link: (Excess Flood)")
+                    with self.lock:
+                        self.open = False
+                    try:
+                        # the plain socket is shut down, a tls socket would stop decrypting what is still to be read
+                        socket.socket.shutdown(self.connection, socket.SHUT_WR)
+                    except OSError:
+                        pass
+                    continue
+                if not self.open:
+                    break
+                self.handle(line)
+            if not self.open and not self.flooded:
+                break
+        with self.lock:
+            self.open = False
+        self.connection.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="local irc server for the ircRelay harness")
+    parser.add_argument("--port", type=int, default=0, help="port to listen on, 0 picks a free one")
+    parser.add_argument("--port-file", help="file the chosen port is written to once the server listens")
+    parser.add_argument("--ping", type=float, default=1, help="seconds between pings, 0 disables them")
+    parser.add_argument("--ping-timeout", type=float, default=30, help="seconds without a pong before the link gets closed")
+    parser.add_argument("--flood", type=int, default=0, help="lines per second before an excess flood disconnect")
+    parser.add_argument("--flood-limit", type=int, default=0, help="links closed for excess flood at most, 0 closes every one")
+    parser.add_argument("--slow", type=int, default=0, help="bytes per second read from the relay")
+    parser.add_argument("--tls", action="store_true", help="speak tls with a self-signed certificate")
+    options = parser.parse_args()
+
+    # one context for all connections, so the tickets it hands out can be used to resume on the next one
+    context = None
+    if options.tls:
+        directory = tempfile.mkdtemp(prefix="mockircd-")
+        certificate = os.path.join(directory, "cert.pem")
+        key = os.path.join(directory, "key.pem")
+        try:
+            subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1", "-subj", "/CN=127.0.0.1",
+                            "-keyout", key, "-out", certificate], check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+            context.load_cert_chain(certificate, key)
+        finally:
+            shutil.rmtree(directory)
+
+    server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    if options.slow > 0:
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+    server.bind(("127.0.0.1", options.port))
+    server.listen(4)
+    if options.port_file:
+        with open(options.port_file + ".tmp", "w") as file:
+            file.write("%d\n" % server.getsockname()[1])
+        os.rename(options.port_file + ".tmp", options.port_file)
+
+    tally = Tally()
+    while True:
+        connection, _ = server.accept()
+        if context is not None:
+            connection = context.wrap_socket(connection, server_side=True, do_handshake_on_connect=False)
+        threading.Thread(target=Client(options, tally, connection).run, daemon=True).start()
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except KeyboardInterrupt:
+        sys.exit(0)
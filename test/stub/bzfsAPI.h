@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2024 Dirk Sarodnick
+ * All rights reserved.
+ */
+
+// the parts of the bzfs 2.4 plugin API the relay uses, so it can be built and driven without a server
+#pragma once
+
+#include <string>
+#include <vector>
+
+#define BZF_API
+#define BZ_SERVER -2
+#define BZ_ALLUSERS -1
+#define BZ_NULLUSER -3
+
+#define bz_perm_setAll "setAll"
+#define bz_perm_viewReports "viewReports"
+
+class bz_ApiString {
+    public:
+        bz_ApiString() {}
+        bz_ApiString(const char* text) : text(text) {}
+        bz_ApiString(const std::string& text) : text(text) {}
+
+        bool operator==(const char* other) const { return text == other; }
+        bool operator==(const std::string& other) const { return text == other; }
+        bool operator!=(const char* other) const { return text != other; }
+        operator std::string() const { return text; }
+
+        const char* c_str() const { return text.c_str(); }
+        unsigned int size() const { return (unsigned int)text.size(); }
+        bool empty() const { return text.empty(); }
+
+    private:
+        std::string text;
+};
+
+class bz_APIStringList {
+    public:
+        unsigned int size() const { return (unsigned int)items.size(); }
+        const bz_ApiString& get(unsigned int i) const { return items[i]; }
+        const bz_ApiString& operator[](unsigned int i) const { return items[i]; }
+        void push_back(const bz_ApiString& item) { items.push_back(item); }
+
+    private:
+        std::vector<bz_ApiString> items;
+};
+
+class bz_APIIntList {
+    public:
+        unsigned int size() const { return (unsigned int)items.size(); }
+        int get(unsigned int i) const { return items[i]; }
+        int& operator[](unsigned int i) { return items[i]; }
+        void push_back(int item) { items.push_back(item); }
+
+    private:
+        std::vector<int> items;
+};
+
+typedef enum {
+    eNoTeam = -1,
+    eRogueTeam = 0,
+    eRedTeam,
+    eGreenTeam,
+    eBlueTeam,
+    ePurpleTeam,
+    eRabbitTeam,
+    eHunterTeam,
+    eObservers,
+    eAdministrators
+} bz_eTeamType;
+
+typedef enum {
+    eFFAGame = 0,
+    eCTFGame,
+    eRabbitGame,
+    eOpenFFAGame
+} bz_eGameType;
+
+typedef enum {
+    eChatMessage,
+    eActionMessage
+} bz_eMessageType;
+
+typedef enum {
+    bz_eWins,
+    bz_eLosses,
+    bz_eTKs
+} bz_eScoreElement;
+
+typedef enum {
+    bz_eNullEvent = 0,
+    bz_eCaptureEvent,
+    bz_ePlayerDieEvent,
+    bz_ePlayerSpawnEvent,
+    bz_ePlayerJoinEvent,
+    bz_ePlayerPartEvent,
+    bz_eRawChatMessageEvent,
+    bz_eTickEvent,
+    bz_eGameStartEvent,
+    bz_eGameEndEvent,
+    bz_eBZDBChange,
+    bz_eReportFiledEvent,
+    bz_ePlayerScoreChanged,
+    bz_eTeamScoreChanged,
+    bz_eLastEvent
+} bz_eEventType;
+
+class bz_EventData {
+    public:
+        bz_EventData(bz_eEventType type = bz_eNullEvent) : eventType(type), eventTime(0) {}
+        virtual ~bz_EventData() {}
+
+        bz_eEventType eventType;
+        double eventTime;
+};
+
+class bz_BasePlayerRecord {
+    public:
+        int playerID;
+        bz_ApiString callsign;
+        bz_ApiString ipAddress;
+        bz_eTeamType team;
+        int wins;
+        int losses;
+        int teamKills;
+};
+
+class bz_PlayerUpdateState {};
+
+class bz_ChatEventData_V2 : public bz_EventData {
+    public:
+        bz_ChatEventData_V2() : bz_EventData(bz_eRawChatMessageEvent), from(0), to(BZ_ALLUSERS), team(eNoTeam), messageType(eChatMessage) {}
+
+        int from;
+        int to;
+        bz_eTeamType team;
+        bz_ApiString message;
+        bz_eMessageType messageType;
+};
+
+class bz_PlayerJoinPartEventData_V1 : public bz_EventData {
+    public:
+        bz_PlayerJoinPartEventData_V1(bz_eEventType type) : bz_EventData(type), playerID(0), record(nullptr) {}
+
+        int playerID;
+        bz_BasePlayerRecord* record;
+        bz_ApiString reason;
+};
+
+class bz_BZDBChangeData_V1 : public bz_EventData {
+    public:
+        bz_BZDBChangeData_V1() : bz_EventData(bz_eBZDBChange) {}
+
+        bz_ApiString key;
+        bz_ApiString value;
+};
+
+class bz_TickEventData_V1 : public bz_EventData {
+    public:
+        bz_TickEventData_V1() : bz_EventData(bz_eTickEvent) {}
+};
+
+class bz_PlayerSpawnEventData_V1 : public bz_EventData {
+    public:
+        bz_PlayerSpawnEventData_V1() : bz_EventData(bz_ePlayerSpawnEvent), playerID(0), team(eNoTeam) {}
+
+        int playerID;
+        bz_eTeamType team;
+        bz_PlayerUpdateState state;
+};
+
+class bz_PlayerDieEventData_V2 : public bz_EventData {
+    public:
+        bz_PlayerDieEventData_V2() : bz_EventData(bz_ePlayerDieEvent), playerID(0), team(eNoTeam), killerID(0), killerTeam(eNoTeam), flagHeldWhenKilled(-1), shotID(-1) {}
+
+        int playerID;
+        bz_eTeamType team;
+        int killerID;
+        bz_eTeamType killerTeam;
+        bz_ApiString flagKilledWith;
+        int flagHeldWhenKilled;
+        int shotID;
+};
+
+class bz_CTFCaptureEventData_V1 : public bz_EventData {
+    public:
+        bz_CTFCaptureEventData_V1() : bz_EventData(bz_eCaptureEvent), teamCapped(eNoTeam), teamCapping(eNoTeam), playerCapping(0), rot(0) {}
+
+        bz_eTeamType teamCapped;
+        bz_eTeamType teamCapping;
+        int playerCapping;
+        float pos[3];
+        float rot;
+};
+
+class bz_GameStartEndEventData_V2 : public bz_EventData {
+    public:
+        bz_GameStartEndEventData_V2(bz_eEventType type) : bz_EventData(type), duration(0), playerID(0), gameStartTime(0) {}
+
+        double duration;
+        int playerID;
+        int gameStartTime;
+};
+
+class bz_ReportFiledEventData_V1 : public bz_EventData {
+    public:
+        bz_ReportFiledEventData_V1() : bz_EventData(bz_eReportFiledEvent), playerID(0) {}
+
+        int playerID;
+        bz_ApiString message;
+};
+
+class bz_PlayerScoreChangeEventData_V1 : public bz_EventData {
+    public:
+        bz_PlayerScoreChangeEventData_V1() : bz_EventData(bz_ePlayerScoreChanged), playerID(0), element(bz_eWins), thisValue(0), lastValue(0) {}
+
+        int playerID;
+        bz_eScoreElement element;
+        int thisValue;
+        int lastValue;
+};
+
+class bz_CustomSlashCommandHandler {
+    public:
+        virtual ~bz_CustomSlashCommandHandler() {}
+        virtual bool SlashCommand(int playerID, bz_ApiString command, bz_ApiString message, bz_APIStringList* params) = 0;
+};
+
+class bz_Plugin {
+    public:
+        bz_Plugin() : MaxWaitTime(-1), Unloadable(true) {}
+        virtual ~bz_Plugin() {}
+
+        virtual const char* Name() = 0;
+        virtual void Init(const char* config) = 0;
+        virtual void Event(bz_EventData* eventData) {}
+        virtual void Cleanup() {}
+
+        float MaxWaitTime;
+        bool Unloadable;
+
+    protected:
+        bool Register(bz_eEventType eventType) { return true; }
+        bool Remove(bz_eEventType eventType) { return true; }
+        void Flush() {}
+};
+
+#define BZ_PLUGIN(name) bz_Plugin* bz_GetPlugin() { return new name; }
+
+BZF_API void bz_debugMessage(int level, const char* message);
+BZF_API bool bz_sendTextMessage(int from, int to, const char* message);
+BZF_API bool bz_sendTextMessage(int from, int to, bz_eMessageType type, const char* message);
+BZF_API bool bz_registerCustomSlashCommand(const char* command, bz_CustomSlashCommandHandler* handler);
+BZF_API bool bz_removeCustomSlashCommand(const char* command);
+BZF_API bool bz_hasPerm(int playerID, const char* perm);
+
+BZF_API bz_APIIntList* bz_newIntList();
+BZF_API void bz_deleteIntList(bz_APIIntList* list);
+BZF_API bool bz_getPlayerIndexList(bz_APIIntList* playerList);
+BZF_API bz_BasePlayerRecord* bz_getPlayerByIndex(int index);
+BZF_API bool bz_freePlayerRecord(bz_BasePlayerRecord* playerRecord);
+BZF_API int bz_getTeamWins(bz_eTeamType team);
+BZF_API int bz_getTeamLosses(bz_eTeamType team);
+
+BZF_API double bz_getCurrentTime();
+BZF_API bz_eGameType bz_getGameType();
+BZF_API bz_ApiString bz_getPublicDescription();
+BZF_API int bz_getPublicPort();
+
+BZF_API bool bz_BZDBItemExists(const char* variable);
+BZF_API bz_ApiString bz_getBZDBString(const char* variable);
+BZF_API bool bz_registerCustomBZDBString(const char* name, const char* value, int perms = 0, bool persistent = false);
+BZF_API bool bz_registerCustomBZDBInt(const char* name, int value, int perms = 0, bool persistent = false);
+BZF_API bool bz_registerCustomBZDBDouble(const char* name, double value, int perms = 0, bool persistent = false);
+BZF_API bool bz_registerCustomBZDBBool(const char* name, bool value, int perms = 0, bool persistent = false);
+BZF_API bool bz_removeCustomBZDBVariable(const char* name);
+
+// control of the stub, for the harness and the benchmarks
+typedef void (*bz_stubMessageHandler)(int from, int to, const char* message);
+void bz_stubSetBZDB(const char* name, const char* value);
+void bz_stubSetDebugLevel(int level);
+void bz_stubSetPublicPort(int port);
+void bz_stubAddPlayer(int playerID, const char* callsign, bz_eTeamType team);
+void bz_stubRemovePlayer(int playerID);
+unsigned long long bz_stubMessages();
+std::string bz_stubLastMessage();
+void bz_stubSetMessageHandler(bz_stubMessageHandler handler);
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2024 Dirk Sarodnick
+ * All rights reserved.
+ */
+#include "bzfsAPI.h"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+
+// the variables and players are only touched by the thread that drives the plugin, like in bzfs
+static std::map<std::string, std::string> bzdb;
+static std::map<int, bz_BasePlayerRecord> players;
+static std::atomic<unsigned long long> messages(0);
+static std::mutex lastMutex;
+static std::string last;
+static int debugLevel = 0;
+static int publicPort = 5154;
+static bz_stubMessageHandler messageHandler = NULL;
+
+void bz_debugMessage(int level, const char* message) {
+    if (level <= debugLevel) fprintf(stderr, "%d: %s\n", level, message);
+}
+
+bool bz_sendTextMessage(int from, int to, const char* message) {
+    return bz_sendTextMessage(from, to, eChatMessage, message);
+}
+
+bool bz_sendTextMessage(int from, int to, bz_eMessageType type, const char* message) {
+    messages++;
+    if (messageHandler != NULL) messageHandler(from, to, message);
+    std::lock_guard<std::mutex> lock(lastMutex);
+    last = message;
+    return true;
+}
+
+bool bz_registerCustomSlashCommand(const char* command, bz_CustomSlashCommandHandler* handler) {
+    return true;
+}
+
+bool bz_removeCustomSlashCommand(const char* command) {
+    return true;
+}
+
+bool bz_hasPerm(int playerID, const char* perm) {
+    return true;
+}
+
+bz_APIIntList* bz_newIntList() {
+    return new bz_APIIntList();
+}
+
+void bz_deleteIntList(bz_APIIntList* list) {
+    delete list;
+}
+
+bool bz_getPlayerIndexList(bz_APIIntList* playerList) {
+    for (std::map<int, bz_BasePlayerRecord>::iterator it = players.begin(); it != players.end(); ++it) playerList->push_back(it->first);
+    return true;
+}
+
+bz_BasePlayerRecord* bz_getPlayerByIndex(int index) {
+    std::map<int, bz_BasePlayerRecord>::iterator it = players.find(index);
+    return it != players.end() ? new bz_BasePlayerRecord(it->second) : NULL;
+}
+
+bool bz_freePlayerRecord(bz_BasePlayerRecord* playerRecord) {
+    delete playerRecord;
+    return true;
+}
+
+int bz_getTeamWins(bz_eTeamType team) {
+    return 0;
+}
+
+int bz_getTeamLosses(bz_eTeamType team) {
+    return 0;
+}
+
+double bz_getCurrentTime() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bz_eGameType bz_getGameType() {
+    return eCTFGame;
+}
+
+bz_ApiString bz_getPublicDescription() {
+    return "ircRelay harness";
+}
+
+int bz_getPublicPort() {
+    return publicPort;
+}
+
+bool bz_BZDBItemExists(const char* variable) {
+    return bzdb.find(variable) != bzdb.end();
+}
+
+bz_ApiString bz_getBZDBString(const char* variable) {
+    std::map<std::string, std::string>::iterator it = bzdb.find(variable);
+    return it != bzdb.end() ? it->second : "";
+}
+
+bool bz_registerCustomBZDBString(const char* name, const char* value, int perms, bool persistent) {
+    if (bzdb.find(name) == bzdb.end()) bzdb[name] = value;
+    return true;
+}
+
+bool bz_registerCustomBZDBInt(const char* name, int value, int perms, bool persistent) {
+    return bz_registerCustomBZDBString(name, std::to_string(value).c_str(), perms, persistent);
+}
+
+bool bz_registerCustomBZDBDouble(const char* name, double value, int perms, bool persistent) {
+    return bz_registerCustomBZDBString(name, std::to_string(value).c_str(), perms, persistent);
+}
+
+bool bz_registerCustomBZDBBool(const char* name, bool value, int perms, bool persistent) {
+    return bz_registerCustomBZDBString(name, value ? "1" : "0", perms, persistent);
+}
+
+bool bz_removeCustomBZDBVariable(const char* name) {
+    bzdb.erase(name);
+    return true;
+}
+
+void bz_stubSetBZDB(const char* name, const char* value) {
+    bzdb[name] = value;
+}
+
+void bz_stubSetDebugLevel(int level) {
+    debugLevel = level;
+}
+
+void bz_stubSetPublicPort(int port) {
+    publicPort = port;
+}
+
+void bz_stubAddPlayer(int playerID, const char* callsign, bz_eTeamType team) {
+    bz_BasePlayerRecord& record = players[playerID];
+    record.playerID = playerID;
+    record.callsign = callsign;
+    record.ipAddress = "127.0.0.1";
+    record.team = team;
+    record.wins = 0;
+    record.losses = 0;
+    record.teamKills = 0;
+}
+
+void bz_stubRemovePlayer(int playerID) {
+    players.erase(playerID);
+}
+
+unsigned long long bz_stubMessages() {
+    return messages;
+}
+
+std::string bz_stubLastMessage() {
+    std::lock_guard<std::mutex> lock(lastMutex);
+    return last;
+}
+
+void bz_stubSetMessageHandler(bz_stubMessageHandler handler) {
+    messageHandler = handler;
+}
@@ -0,0 +1,7 @@
+/*
+ * Copyright (C) 2024 Dirk Sarodnick
+ * All rights reserved.
+ */
+
+// the relay does not use any of the plugin utilities, this only satisfies the include
+#pragma once